@@ -0,0 +1,136 @@
+// Host micro-benchmark of the firmware's decompression code.
+//
+// Usage: decodebench <reference file> <compressed file>...
+//
+// Each compressed file (an lz4 frame, or an lzma stream as written by
+// "xz --format=lzma" or cbfstool) is decoded repeatedly with the same
+// decoder source used by the rom, checked against the reference file,
+// and the decode throughput is reported.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fw/lzmadecode.h" // LzmaDecode
+
+// fw/lz4decode.h uses the rom's types.h, which clashes with the host
+// headers above.
+#define LZ4_FRAME_MAGIC 0x184D2204
+int lz4_decode(void *dst, unsigned int maxlen
+               , const void *src, unsigned int srclen);
+
+// Minimum time spent decoding each file
+#define BENCH_MIN_NS 500000000ULL
+
+static unsigned char *
+readfile(const char *name, size_t *psize, size_t padding)
+{
+    FILE *f = fopen(name, "rb");
+    if (!f) {
+        perror(name);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    // Decoders may read a little past the end of their input.
+    unsigned char *data = calloc(1, size + padding);
+    if (!data || fread(data, 1, size, f) != size) {
+        fprintf(stderr, "Unable to read %s\n", name);
+        exit(1);
+    }
+    fclose(f);
+    *psize = size;
+    return data;
+}
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Decode an lzma stream - returns the decoded size or -1.  The size
+// recorded in the stream header may be unknown, so the caller gives it.
+static int
+decode_lzma(unsigned char *dst, size_t dstlen
+            , const unsigned char *src, size_t srclen)
+{
+    static CProb *probs;
+    static size_t probsize;
+    CLzmaDecoderState state;
+    memset(&state, 0, sizeof(state));
+    if (srclen < LZMA_PROPERTIES_SIZE + 8
+        || LzmaDecodeProperties(&state.Properties, src, LZMA_PROPERTIES_SIZE)
+           != LZMA_RESULT_OK)
+        return -1;
+    size_t need = LzmaGetNumProbs(&state.Properties) * sizeof(CProb);
+    if (need > probsize) {
+        free(probs);
+        probs = malloc(need);
+        probsize = need;
+    }
+    state.Probs = probs;
+    SizeT inProcessed, outProcessed;
+    int ret = LzmaDecode(&state, src + LZMA_PROPERTIES_SIZE + 8
+                         , srclen - LZMA_PROPERTIES_SIZE - 8
+                         , &inProcessed, dst, dstlen, &outProcessed);
+    if (ret != LZMA_RESULT_OK)
+        return -1;
+    return outProcessed;
+}
+
+static void
+bench(const char *name, const unsigned char *ref, size_t reflen)
+{
+    size_t srclen;
+    unsigned char *src = readfile(name, &srclen, LZMA_IN_PADDING);
+    unsigned char *dst = malloc(reflen + 1);
+    unsigned int magic = 0;
+    memcpy(&magic, src, srclen < sizeof(magic) ? srclen : sizeof(magic));
+    int islz4 = magic == LZ4_FRAME_MAGIC;
+    const char *format = islz4 ? "lz4" : "lzma";
+
+    unsigned long long start = now_ns(), end;
+    int count = 0;
+    do {
+        int ret = (islz4 ? lz4_decode(dst, reflen, src, srclen)
+                   : decode_lzma(dst, reflen, src, srclen));
+        if (ret != reflen || memcmp(dst, ref, reflen)) {
+            fprintf(stderr, "%s: %s decode does not match the reference\n"
+                    , name, format);
+            exit(1);
+        }
+        count++;
+        end = now_ns();
+    } while (end - start < BENCH_MIN_NS);
+
+    double secs = (end - start) / 1e9;
+    printf("%-32s %-5s %8zu -> %8zu bytes %6d runs %9.1f MB/s\n"
+           , name, format, srclen, reflen, count
+           , (double)reflen * count / secs / 1e6);
+    free(dst);
+    free(src);
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <reference file> <compressed file>...\n"
+                , argv[0]);
+        return 1;
+    }
+    size_t reflen;
+    unsigned char *ref = readfile(argv[1], &reflen, 0);
+    int i;
+    for (i = 2; i < argc; i++)
+        bench(argv[i], ref, reflen);
+    free(ref);
+    return 0;
+}
@@ -33,6 +33,7 @@
 #define BUILD_STACK_ADDR          0x7000
 #define BUILD_S3RESUME_STACK_ADDR 0x1000
 #define BUILD_AP_BOOT_ADDR        0x10000
+#define BUILD_AP_STACK_SIZE       1024
 #define BUILD_EBDA_MINIMUM        0x90000
 #define BUILD_LOWRAM_END          0xa0000
 #define BUILD_ROM_START           0xc0000
@@ -94,7 +95,7 @@
 #define DEBUG_ISR_hwpic1 5
 #define DEBUG_ISR_hwpic2 5
 #define DEBUG_HDL_smi 9
-#define DEBUG_HDL_smp 1
+#define DEBUG_HDL_smp 3
 #define DEBUG_HDL_pnp 1
 #define DEBUG_HDL_pmm 1
 #define DEBUG_HDL_pcibios 9
@@ -103,6 +104,7 @@
 #define DEBUG_unimplemented 2
 #define DEBUG_invalid 3
 #define DEBUG_thread 2
+#define DEBUG_thread_profile 3
 #define DEBUG_tcg 20
 
 #endif // config.h
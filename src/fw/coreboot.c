@@ -9,6 +9,7 @@
 #include "config.h" // CONFIG_*
 #include "e820map.h" // e820_add
 #include "hw/pcidevice.h" // pci_probe_devices
+#include "lz4decode.h" // lz4_decode
 #include "lzmadecode.h" // LzmaDecode
 #include "malloc.h" // free
 #include "output.h" // dprintf
@@ -291,37 +292,72 @@ coreboot_platform_setup(void)
  * ulzma
  ****************************************************************/
 
-// Uncompress data in flash to an area of memory.
+// Size of the probability tables needed to decode an lzma stream
+// (zero if the stream header is invalid).
+static u32
+ulzma_probsize(const u8 *src)
+{
+    CLzmaProperties props;
+    if (LzmaDecodeProperties(&props, src, LZMA_PROPERTIES_SIZE)
+        != LZMA_RESULT_OK)
+        return 0;
+    return LzmaGetNumProbs(&props) * sizeof(CProb);
+}
+
+// Size of the read-ahead window used when decoding straight from flash.
+#define ULZMA_WINDOW_SIZE 4096
+
+// Uncompress data in flash to an area of memory.  The probability
+// tables are kept in 'probs' (of 'probsize' bytes).  If 'window' (of
+// ULZMA_WINDOW_SIZE + LZMA_IN_PADDING bytes) is given, the compressed
+// data is streamed from flash through it with iomemcpy().  Otherwise
+// it is read in place and LzmaDecode() may read up to LZMA_IN_PADDING
+// bytes past the end of 'src'.
 static int
-ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen)
+ulzma(u8 *dst, u32 maxlen, const u8 *src, u32 srclen
+      , void *probs, u32 probsize, void *window)
 {
     dprintf(3, "Uncompressing data %d@%p to %d@%p\n", srclen, src, maxlen, dst);
     CLzmaDecoderState state;
+    memset(&state, 0, sizeof(state));
     int ret = LzmaDecodeProperties(&state.Properties, src, LZMA_PROPERTIES_SIZE);
     if (ret != LZMA_RESULT_OK) {
         dprintf(1, "LzmaDecodeProperties error - %d\n", ret);
         return -1;
     }
-    u8 scratch[15980];
-    int need = (LzmaGetNumProbs(&state.Properties) * sizeof(CProb));
-    if (need > sizeof(scratch)) {
-        dprintf(1, "LzmaDecode need %d have %d\n", need, (unsigned int)sizeof(scratch));
+    if (srclen < LZMA_PROPERTIES_SIZE + 8) {
+        dprintf(1, "LzmaDecode input too short (%d)\n", srclen);
+        return -1;
+    }
+    u32 need = ulzma_probsize(src);
+    if (need > probsize) {
+        dprintf(1, "LzmaDecode need %d have %d\n", need, probsize);
         return -1;
     }
-    state.Probs = (CProb *)scratch;
+    state.Probs = probs;
+    if (window) {
+        state.Window = window;
+        state.WindowSize = ULZMA_WINDOW_SIZE;
+        state.ReadInput = iomemcpy;
+    }
 
     u32 dstlen = *(u32*)(src + LZMA_PROPERTIES_SIZE);
     if (dstlen > maxlen) {
         dprintf(1, "LzmaDecode too large (max %d need %d)\n", maxlen, dstlen);
         return -1;
     }
+    u32 start = timer_read();
     u32 inProcessed, outProcessed;
-    ret = LzmaDecode(&state, src + LZMA_PROPERTIES_SIZE + 8, srclen
+    ret = LzmaDecode(&state, src + LZMA_PROPERTIES_SIZE + 8
+                     , srclen - LZMA_PROPERTIES_SIZE - 8
                      , &inProcessed, dst, dstlen, &outProcessed);
     if (ret) {
         dprintf(1, "LzmaDecode returned %d\n", ret);
         return -1;
     }
+    u32 us = timer_ticks_to_us(timer_read() - start);
+    dprintf(3, "Uncompressed %d bytes in %d us (%d KiB/s)\n"
+            , dstlen, us, us >= 1000 ? (dstlen / 1024) * 1000 / (us / 1000) : 0);
     return dstlen;
 }
 
@@ -349,16 +385,35 @@ struct cbfs_file {
     u64 magic;
     u32 len;
     u32 type;
-    u32 checksum;
+    u32 attributes_offset;
     u32 offset;
     char filename[0];
 } PACKED;
 
+struct cbfs_file_attribute {
+    u32 tag;
+    u32 len;
+} PACKED;
+
+#define CBFS_FILE_ATTR_TAG_UNUSED       0
+#define CBFS_FILE_ATTR_TAG_UNUSED2      0xffffffff
+#define CBFS_FILE_ATTR_TAG_COMPRESSION  0x42435a4c
+
+struct cbfs_file_attr_compression {
+    struct cbfs_file_attribute hdr;
+    u32 compression;
+    u32 decompressed_size;
+} PACKED;
+
+#define CBFS_COMPRESS_NONE  0
+#define CBFS_COMPRESS_LZMA  1
+#define CBFS_COMPRESS_LZ4   2
+
 struct cbfs_romfile_s {
     struct romfile_s file;
     struct cbfs_file *fhdr;
     void *data;
-    u32 rawsize, flags;
+    u32 rawsize, flags; // flags is the CBFS_COMPRESS_* algorithm
 };
 
 // Copy a file to memory (uncompressing if necessary)
@@ -372,17 +427,35 @@ cbfs_copyfile(struct romfile_s *file, void *dst, u32 maxlen)
     cfile = container_of(file, struct cbfs_romfile_s, file);
     u32 size = cfile->rawsize;
     void *src = cfile->data;
+    if (cfile->flags == CBFS_COMPRESS_LZ4) {
+        // lz4 is cheap to decode straight from flash.
+        if (!CONFIG_LZ4)
+            return -1;
+        dprintf(3, "Uncompressing lz4 data %d@%p to %d@%p\n"
+                , size, src, maxlen, dst);
+        int ret = lz4_decode(dst, maxlen, src, size);
+        if (ret < 0)
+            dprintf(1, "lz4_decode failed for '%s'\n", file->name);
+        yield();
+        return ret;
+    }
     if (cfile->flags) {
-        // Compressed - copy to temp ram and uncompress it.
-        void *temp = malloc_tmphigh(size);
-        if (!temp) {
-            warn_noalloc();
+        // Compressed - stream it from flash through a small window
+        // (the probability tables go on the heap, so any lc+lp works).
+        u32 probsize = ulzma_probsize(src);
+        void *probs = malloc_tmphigh(probsize);
+        void *window = malloc_tmphigh(ULZMA_WINDOW_SIZE + LZMA_IN_PADDING);
+        if (!probsize || !probs || !window) {
+            if (probsize)
+                warn_noalloc();
+            free(window);
+            free(probs);
             return -1;
         }
-        iomemcpy(temp, src, size);
-        int ret = ulzma(dst, maxlen, temp, size);
+        int ret = ulzma(dst, maxlen, src, size, probs, probsize, window);
         yield();
-        free(temp);
+        free(window);
+        free(probs);
         return ret;
     }
 
@@ -396,6 +469,19 @@ cbfs_copyfile(struct romfile_s *file, void *dst, u32 maxlen)
     return size;
 }
 
+// Read part of an uncompressed file
+static int
+cbfs_readfile(struct romfile_s *file, void *dst, u32 offset, u32 len)
+{
+    if (!CONFIG_COREBOOT_FLASH)
+        return -1;
+
+    struct cbfs_romfile_s *cfile;
+    cfile = container_of(file, struct cbfs_romfile_s, file);
+    iomemcpy(dst, cfile->data + offset, len);
+    return len;
+}
+
 // Process CBFS links file.  The links file is a newline separated
 // file where each line has a "link name" and a "destination name"
 // separated by a space character.
@@ -436,6 +522,39 @@ process_links_file(void)
     free(links);
 }
 
+// Find the compression attribute of a file - returns the CBFS_COMPRESS_*
+// algorithm (and the decompressed size) or -1 if there is none.
+static int
+cbfs_file_compression(struct cbfs_file *fhdr, u32 *psize)
+{
+    u32 attr = be32_to_cpu(fhdr->attributes_offset);
+    u32 end = be32_to_cpu(fhdr->offset);
+    if (!attr)
+        return -1;
+    while (attr + sizeof(struct cbfs_file_attribute) <= end) {
+        struct cbfs_file_attribute *a = (void*)fhdr + attr;
+        u32 tag = be32_to_cpu(a->tag), len = be32_to_cpu(a->len);
+        if (tag == CBFS_FILE_ATTR_TAG_UNUSED
+            || tag == CBFS_FILE_ATTR_TAG_UNUSED2 || len < sizeof(*a))
+            break;
+        if (tag == CBFS_FILE_ATTR_TAG_COMPRESSION
+            && len >= sizeof(struct cbfs_file_attr_compression)) {
+            struct cbfs_file_attr_compression *c = (void*)a;
+            int algo = be32_to_cpu(c->compression);
+            if (algo != CBFS_COMPRESS_NONE && algo != CBFS_COMPRESS_LZMA
+                && (!CONFIG_LZ4 || algo != CBFS_COMPRESS_LZ4)) {
+                dprintf(1, "No support for compression type %x of '%s'\n"
+                        , algo, fhdr->filename);
+                return -1;
+            }
+            *psize = be32_to_cpu(c->decompressed_size);
+            return algo;
+        }
+        attr += len;
+    }
+    return -1;
+}
+
 void
 coreboot_cbfs_init(void)
 {
@@ -476,14 +595,31 @@ coreboot_cbfs_init(void)
         cfile->file.size = cfile->rawsize = be32_to_cpu(fhdr->len);
         cfile->fhdr = fhdr;
         cfile->file.copy = cbfs_copyfile;
+        cfile->file.read = cbfs_readfile;
         cfile->data = (void*)fhdr + be32_to_cpu(fhdr->offset);
         int len = strlen(cfile->file.name);
-        if (len > 5 && strcmp(&cfile->file.name[len-5], ".lzma") == 0) {
+        u32 dsize;
+        int algo = cbfs_file_compression(fhdr, &dsize);
+        if (algo > CBFS_COMPRESS_NONE) {
+            cfile->flags = algo;
+            cfile->file.size = dsize;
+        } else if (len > 5 && strcmp(&cfile->file.name[len-5], ".lzma") == 0) {
             // Using compression.
-            cfile->flags = 1;
+            cfile->flags = CBFS_COMPRESS_LZMA;
             cfile->file.name[len-5] = '\0';
             cfile->file.size = *(u32*)(cfile->data + LZMA_PROPERTIES_SIZE);
+        } else if (CONFIG_LZ4 && len > 4
+                   && strcmp(&cfile->file.name[len-4], ".lz4") == 0) {
+            int csize = lz4_content_size(cfile->data, cfile->rawsize);
+            if (csize >= 0) {
+                cfile->flags = CBFS_COMPRESS_LZ4;
+                cfile->file.name[len-4] = '\0';
+                cfile->file.size = csize;
+            }
         }
+        if (cfile->flags)
+            // Partial reads go through the romfile content cache.
+            cfile->file.read = NULL;
         romfile_add(&cfile->file);
 
         fhdr = (void*)ALIGN((u32)cfile->data + cfile->rawsize
@@ -505,9 +641,6 @@ struct cbfs_payload_segment {
 #define PAYLOAD_SEGMENT_BSS    0x20535342
 #define PAYLOAD_SEGMENT_ENTRY  0x52544E45
 
-#define CBFS_COMPRESS_NONE  0
-#define CBFS_COMPRESS_LZMA  1
-
 struct cbfs_payload {
     struct cbfs_payload_segment segments[1];
 };
@@ -545,7 +678,15 @@ cbfs_run_payload(struct cbfs_file *fhdr)
                 memcpy(dest, src, src_len);
             } else if (CONFIG_LZMA
                        && seg->compression == cpu_to_be32(CBFS_COMPRESS_LZMA)) {
-                int ret = ulzma(dest, dest_len, src, src_len);
+                u8 scratch[15980];
+                int ret = ulzma(dest, dest_len, src, src_len
+                                , scratch, sizeof(scratch), NULL);
+                if (ret < 0)
+                    return;
+                src_len = ret;
+            } else if (CONFIG_LZ4
+                       && seg->compression == cpu_to_be32(CBFS_COMPRESS_LZ4)) {
+                int ret = lz4_decode(dest, dest_len, src, src_len);
                 if (ret < 0)
                     return;
                 src_len = ret;
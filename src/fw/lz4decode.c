@@ -0,0 +1,169 @@
+// LZ4 frame format decompression.
+//
+// This file may be distributed under the terms of the GNU LGPLv3 license.
+
+#include "byteorder.h" // le32_to_cpu
+#include "lz4decode.h" // lz4_decode
+#include "string.h" // memcpy
+
+// FLG byte of the frame descriptor
+#define LZ4_FLG_VERSION_MASK    0xc0
+#define LZ4_FLG_VERSION         0x40
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_DICT_ID         0x01
+
+#define LZ4_BLOCK_UNCOMPRESSED  0x80000000
+#define LZ4_MIN_MATCH           4
+
+// Parse the frame header - returns its length or -1 if invalid.
+static int
+lz4_frame_header(const u8 *src, u32 srclen, u8 *pflg, u64 *psize)
+{
+    if (srclen < 7 || le32_to_cpu(*(u32*)src) != LZ4_FRAME_MAGIC)
+        return -1;
+    u8 flg = src[4];
+    if ((flg & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION
+        || flg & LZ4_FLG_DICT_ID)
+        // Unknown version or preset dictionary (not supported)
+        return -1;
+    u32 len = 6;
+    u64 size = -1;
+    if (flg & LZ4_FLG_CONTENT_SIZE) {
+        if (srclen < len + 8)
+            return -1;
+        size = le64_to_cpu(*(u64*)&src[len]);
+        len += 8;
+    }
+    len++; // header checksum
+    if (srclen < len)
+        return -1;
+    *pflg = flg;
+    if (psize)
+        *psize = size;
+    return len;
+}
+
+// Return the decompressed size recorded in the frame header, or -1
+// if the frame does not record it.
+int
+lz4_content_size(const void *src, u32 srclen)
+{
+    u8 flg;
+    u64 size;
+    if (lz4_frame_header(src, srclen, &flg, &size) < 0 || size > 0x7fffffff)
+        return -1;
+    return size;
+}
+
+// Read an extended length (a run of bytes ending in one below 255).
+static const u8 *
+lz4_length(const u8 *src, const u8 *srcend, u32 *plen)
+{
+    u8 b;
+    do {
+        if (src >= srcend)
+            return NULL;
+        b = *src++;
+        *plen += b;
+    } while (b == 255);
+    return src;
+}
+
+// Decode one compressed block to 'dst'.  Matches may reach back to
+// 'base' (the start of the output), as blocks need not be independent.
+static int
+lz4_block(u8 *dst, u8 *dstend, const u8 *src, const u8 *srcend, u8 *base)
+{
+    u8 *d = dst;
+    while (src < srcend) {
+        u8 token = *src++;
+
+        // Literals
+        u32 len = token >> 4;
+        if (len == 15 && !(src = lz4_length(src, srcend, &len)))
+            return -1;
+        if (len > srcend - src || len > dstend - d)
+            return -1;
+        memcpy(d, src, len);
+        d += len;
+        src += len;
+        if (src >= srcend)
+            // The last sequence has no match
+            break;
+
+        // Match
+        if (srcend - src < 2)
+            return -1;
+        u32 offset = src[0] | (src[1] << 8);
+        src += 2;
+        if (!offset || offset > d - base)
+            return -1;
+        len = token & 0x0f;
+        if (len == 15 && !(src = lz4_length(src, srcend, &len)))
+            return -1;
+        len += LZ4_MIN_MATCH;
+        if (len > dstend - d)
+            return -1;
+        const u8 *m = d - offset;
+        if (offset == 1) {
+            memset(d, *m, len);
+            d += len;
+        } else if (offset < 4) {
+            while (len--)
+                *d++ = *m++;
+        } else {
+            // Copy in pieces no larger than the (possibly overlapping)
+            // distance.
+            while (len) {
+                u32 n = len < offset ? len : offset;
+                memcpy(d, m, n);
+                d += n;
+                m += n;
+                len -= n;
+            }
+        }
+    }
+    return d - dst;
+}
+
+// Decompress an lz4 frame - returns the decompressed size or -1.
+// Block and content checksums are not verified.
+int
+lz4_decode(void *dst, u32 maxlen, const void *src, u32 srclen)
+{
+    const u8 *s = src, *send = s + srclen;
+    u8 *d = dst, *dend = d + maxlen;
+    u8 flg;
+    int hdrlen = lz4_frame_header(src, srclen, &flg, NULL);
+    if (hdrlen < 0)
+        return -1;
+    s += hdrlen;
+    for (;;) {
+        if (send - s < 4)
+            return -1;
+        u32 bsize = le32_to_cpu(*(u32*)s);
+        s += 4;
+        if (!bsize)
+            // End mark
+            break;
+        u32 size = bsize & ~LZ4_BLOCK_UNCOMPRESSED;
+        if (size > send - s)
+            return -1;
+        if (bsize & LZ4_BLOCK_UNCOMPRESSED) {
+            if (size > dend - d)
+                return -1;
+            memcpy(d, s, size);
+            d += size;
+        } else {
+            int ret = lz4_block(d, dend, s, s + size, dst);
+            if (ret < 0)
+                return -1;
+            d += ret;
+        }
+        s += size;
+        if (flg & LZ4_FLG_BLOCK_CHECKSUM)
+            s += 4;
+    }
+    return d - (u8*)dst;
+}
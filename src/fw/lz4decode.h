@@ -0,0 +1,14 @@
+#ifndef __LZ4DECODE_H
+#define __LZ4DECODE_H
+
+#include "types.h" // u32
+
+#define LZ4_FRAME_MAGIC      0x184D2204
+// Largest possible frame header (magic, FLG, BD, size, dict id, HC)
+#define LZ4_MAX_HEADER_SIZE  19
+
+// lz4decode.c
+int lz4_content_size(const void *src, u32 srclen);
+int lz4_decode(void *dst, u32 maxlen, const void *src, u32 srclen);
+
+#endif // lz4decode.h
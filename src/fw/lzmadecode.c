@@ -20,6 +20,7 @@
 */
 
 #include "lzmadecode.h"
+#include "string.h" // memcpy
 
 #define kNumTopBits 24
 #define kTopValue ((UInt32)1 << kNumTopBits)
@@ -38,8 +39,18 @@
 
 #define RC_INIT(buffer, bufferSize) Buffer = buffer; BufferLim = buffer + bufferSize; RC_INIT2
  
+/* The input limit is checked once per symbol (see RC_CHECK_LIMIT), not
+   on every byte - one symbol never needs more than kMaxSymbolInput
+   bytes, which stay within LZMA_IN_PADDING. */
+#define kMaxSymbolInput 52
+#if kMaxSymbolInput > LZMA_IN_PADDING
+StopCompilingDueBUG
+#endif
+#define RC_CHECK_LIMIT { if (Buffer > RefillLim) { \
+  if (!InLeft) { if (Buffer > BufferLim) return LZMA_RESULT_DATA_ERROR; } \
+  else LzmaRefill(vs, &Buffer, &BufferLim, &RefillLim, &InStream, &InLeft); } }
 
-#define RC_NORMALIZE if (Range < kTopValue) { RC_TEST; Range <<= 8; Code = (Code << 8) | RC_READ_BYTE; }
+#define RC_NORMALIZE if (Range < kTopValue) { Range <<= 8; Code = (Code << 8) | RC_READ_BYTE; }
 
 #define IfBit0(p) RC_NORMALIZE; bound = (Range >> kNumBitModelTotalBits) * *(p); if (Code < bound)
 #define UpdateBit0(p) Range = bound; *(p) += (kBitModelTotal - *(p)) >> kNumMoveBits;
@@ -130,6 +141,33 @@ int LzmaDecodeProperties(CLzmaProperties *propsRes, const unsigned char *propsDa
   return LZMA_RESULT_OK;
 }
 
+/* Move the unread input to the start of the window and read as much
+   new input after it as fits. */
+static void LzmaRefill(CLzmaDecoderState *vs, const Byte **buffer,
+    const Byte **bufferLim, const Byte **refillLim,
+    const Byte **inStream, SizeT *inLeft)
+{
+  SizeT keep = (SizeT)(*bufferLim - *buffer);
+  SizeT len = vs->WindowSize - keep;
+  if (len > *inLeft)
+    len = *inLeft;
+  memmove(vs->Window, *buffer, keep);
+  vs->ReadInput(vs->Window + keep, *inStream, len);
+  *inStream += len;
+  *inLeft -= len;
+  *buffer = vs->Window;
+  *bufferLim = vs->Window + keep + len;
+  if (*inLeft)
+  {
+    *refillLim = *bufferLim - kMaxSymbolInput;
+  }
+  else
+  {
+    memset(vs->Window + keep + len, 0, LZMA_IN_PADDING);
+    *refillLim = *bufferLim;
+  }
+}
+
 #define kLzmaStreamWasFinishedId (-1)
 
 int LzmaDecode(CLzmaDecoderState *vs,
@@ -149,6 +187,9 @@ int LzmaDecode(CLzmaDecoderState *vs,
   int len = 0;
   const Byte *Buffer;
   const Byte *BufferLim;
+  const Byte *RefillLim;
+  const Byte *InStream = inStream;
+  SizeT InLeft = 0;
   UInt32 Range;
   UInt32 Code;
 
@@ -156,19 +197,40 @@ int LzmaDecode(CLzmaDecoderState *vs,
   *outSizeProcessed = 0;
 
   {
+    /* Initialize two probabilities per store */
     UInt32 i;
     UInt32 numProbs = Literal + ((UInt32)LZMA_LIT_SIZE << (lc + vs->Properties.lp));
-    for (i = 0; i < numProbs; i++)
-      p[i] = kBitModelTotal >> 1;
+    UInt32 *p32 = (UInt32 *)p;
+    for (i = 0; i < numProbs / 2; i++)
+      p32[i] = (kBitModelTotal >> 1) * 0x10001;
+    if (numProbs & 1)
+      p[numProbs - 1] = kBitModelTotal >> 1;
   }
   
-  RC_INIT(inStream, inSize);
+  if (vs->Window)
+  {
+    if (vs->WindowSize <= kMaxSymbolInput)
+      return LZMA_RESULT_DATA_ERROR;
+    /* Start with an empty window */
+    Buffer = BufferLim = vs->Window;
+    InLeft = inSize;
+    LzmaRefill(vs, &Buffer, &BufferLim, &RefillLim, &InStream, &InLeft);
+    RC_INIT2;
+  }
+  else
+  {
+    RC_INIT(inStream, inSize);
+    RefillLim = BufferLim;
+    /* All input is in the buffer - keeps *inSizeProcessed below right */
+    InStream = inStream + inSize;
+  }
 
 
   while(nowPos < outSize)
   {
     CProb *prob;
     UInt32 bound;
+    RC_CHECK_LIMIT;
     int posState = (int)(
         (nowPos 
         )
@@ -379,20 +441,37 @@ int LzmaDecode(CLzmaDecoderState *vs,
       if (rep0 > nowPos)
         return LZMA_RESULT_DATA_ERROR;
 
-
-      do
       {
-        previousByte = outStream[nowPos - rep0];
-        len--;
-        outStream[nowPos++] = previousByte;
+        /* Copy the match in as few pieces as the distance allows */
+        Byte *dest = outStream + nowPos;
+        const Byte *src = dest - rep0;
+        if ((SizeT)len > outSize - nowPos)
+          len = outSize - nowPos;
+        nowPos += len;
+        if (rep0 == 1)
+          memset(dest, *src, len);
+        else if (rep0 < 4)
+          do
+            *dest++ = *src++;
+          while (--len != 0);
+        else
+          while (len != 0)
+          {
+            int n = (UInt32)len < rep0 ? len : (int)rep0;
+            memcpy(dest, src, n);
+            dest += n;
+            src += n;
+            len -= n;
+          }
+        previousByte = outStream[nowPos - 1];
       }
-      while(len != 0 && nowPos < outSize);
     }
   }
   RC_NORMALIZE;
+  RC_CHECK_LIMIT;
 
 
-  *inSizeProcessed = (SizeT)(Buffer - inStream);
+  *inSizeProcessed = (SizeT)(InStream - inStream) - (SizeT)(BufferLim - Buffer);
   *outSizeProcessed = nowPos;
   return LZMA_RESULT_OK;
 }
@@ -38,6 +38,11 @@ typedef UInt32 SizeT;
 
 #define LZMA_PROPERTIES_SIZE 5
 
+/* LzmaDecode() only checks for the end of the input once per decoded
+   symbol, so up to this many bytes past the end of inStream may be
+   read (but are never used without returning an error). */
+#define LZMA_IN_PADDING 64
+
 typedef struct _CLzmaProperties
 {
   int lc;
@@ -56,7 +61,12 @@ typedef struct _CLzmaDecoderState
   CLzmaProperties Properties;
   CProb *Probs;
 
-
+  /* Optional input window.  When Window is set the input is not
+     accessed in place - it is read in pieces with ReadInput() into
+     Window, which must hold WindowSize + LZMA_IN_PADDING bytes. */
+  unsigned char *Window;
+  SizeT WindowSize;
+  void (*ReadInput)(void *dst, const void *src, SizeT len);
 } CLzmaDecoderState;
 
 
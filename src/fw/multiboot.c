@@ -57,6 +57,15 @@ mbfs_copyfile(struct romfile_s *file, void *dst, u32 maxlen)
     return size;
 }
 
+static int
+mbfs_readfile(struct romfile_s *file, void *dst, u32 offset, u32 len)
+{
+    struct mbfs_romfile_s *cfile;
+    cfile = container_of(file, struct mbfs_romfile_s, file);
+    memcpy(dst, cfile->data + offset, len);
+    return len;
+}
+
 u32 __VISIBLE entry_elf_eax, entry_elf_ebx;
 
 /*
@@ -113,6 +122,7 @@ multiboot_init(void)
         }
         memcpy(copy, (void *)mod[i].mod_start, len);
         cfile->file.copy = mbfs_copyfile;
+        cfile->file.read = mbfs_readfile;
         cfile->data = copy;
         romfile_add(&cfile->file);
     }
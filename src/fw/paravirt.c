@@ -414,8 +414,13 @@ qemu_cfg_skip(int len)
     if (qemu_cfg_dma_enabled()) {
         qemu_cfg_dma_transfer(0, len, QEMU_CFG_DMA_CTL_SKIP);
     } else {
-        while (len--)
-            inb(PORT_QEMU_CFG_DATA);
+        // 没有DMA时用rep insb按块读取并丢弃, 而不是逐字节inb
+        u8 discard[128];
+        while (len > 0) {
+            int count = len > sizeof(discard) ? sizeof(discard) : len;
+            insb(PORT_QEMU_CFG_DATA, discard, count);
+            len -= count;
+        }
     }
 }
 
@@ -456,6 +461,7 @@ qemu_cfg_write_entry(void *buf, int e, int len)
 struct qemu_romfile_s {
     struct romfile_s file;
     int select, skip;
+    void *data; // contents read ahead by qemu_cfg_prefetch()
 };
 
 static int
@@ -465,7 +471,9 @@ qemu_cfg_read_file(struct romfile_s *file, void *dst, u32 maxlen)
         return -1;
     struct qemu_romfile_s *qfile;
     qfile = container_of(file, struct qemu_romfile_s, file);
-    if (qfile->skip == 0) {
+    if (qfile->data) {
+        memcpy(dst, qfile->data, file->size);
+    } else if (qfile->skip == 0) {
         /* Do it in one transfer */
         qemu_cfg_read_entry(dst, qfile->select, file->size);
     } else {
@@ -476,6 +484,24 @@ qemu_cfg_read_file(struct romfile_s *file, void *dst, u32 maxlen)
     return file->size;
 }
 
+// Read 'len' bytes at 'offset' - the caller has checked the bounds.
+static int
+qemu_cfg_read_part(struct romfile_s *file, void *dst, u32 offset, u32 len)
+{
+    struct qemu_romfile_s *qfile;
+    qfile = container_of(file, struct qemu_romfile_s, file);
+    if (qfile->data) {
+        memcpy(dst, qfile->data + offset, len);
+    } else if (qfile->skip + offset == 0) {
+        qemu_cfg_read_entry(dst, qfile->select, len);
+    } else {
+        qemu_cfg_select(qfile->select);
+        qemu_cfg_skip(qfile->skip + offset);
+        qemu_cfg_read(dst, len);
+    }
+    return len;
+}
+
 // Bare-bones function for writing a file knowing only its unique
 // identifying key (select)
 int
@@ -502,13 +528,19 @@ qemu_cfg_write_file(void *src, struct romfile_s *file, u32 offset, u32 len)
         warn_internalerror();
         return -1;
     }
+    // Contents changed - drop anything cached by the romfile layer.
+    romfile_invalidate(file);
+    struct qemu_romfile_s *qfile;
+    qfile = container_of(file, struct qemu_romfile_s, file);
+    if (qfile->data)
+        memcpy(qfile->data + offset, src, len);
     return qemu_cfg_write_file_simple(src, qemu_get_romfile_key(file),
                                       offset, len);
 }
 
 /*
  *
- * 添加 qemu_romfile_s对象到 RomfileRoot链表
+ * 添加 qemu_romfile_s对象到 RomfileHash散列表和RomfileSorted索引
  */
 static void
 qemu_romfile_add(char *name, int select, int skip, int size)
@@ -524,9 +556,59 @@ qemu_romfile_add(char *name, int select, int skip, int size)
     qfile->select = select;
     qfile->skip = skip;
     qfile->file.copy = qemu_cfg_read_file;
+    qfile->file.read = qemu_cfg_read_part;
     romfile_add(&qfile->file);
 }
 
+/*
+ * qemu_cfg_init()
+ *  qemu_cfg_prefetch()
+ *
+ * 预先读取一组小文件的内容到同一块内存中, 之后对这些文件的
+ * qemu_cfg_read_file()直接从内存复制, 不再访问fw_cfg端口
+ */
+#define QEMU_CFG_PREFETCH_FILES 32
+#define QEMU_CFG_PREFETCH_SIZE  4096
+
+void
+qemu_cfg_prefetch(const char * const *names, int count)
+{
+    if (!qemu_cfg_enabled())
+        return;
+
+    struct qemu_romfile_s *files[QEMU_CFG_PREFETCH_FILES];
+    u32 total = 0;
+    int i, n = 0;
+    for (i = 0; i < count && n < ARRAY_SIZE(files); i++) {
+        struct romfile_s *file = romfile_find(names[i]);
+        if (!file || file->copy != qemu_cfg_read_file || !file->size
+            || file->size > QEMU_CFG_PREFETCH_SIZE)
+            continue;
+        struct qemu_romfile_s *qfile;
+        qfile = container_of(file, struct qemu_romfile_s, file);
+        if (qfile->data)
+            continue;
+        files[n++] = qfile;
+        total += ALIGN(file->size, 4);
+    }
+    if (!n)
+        return;
+
+    void *buf = malloc_tmp(total);
+    if (!buf) {
+        warn_noalloc();
+        return;
+    }
+    // Read the files back to back; each one is a single transfer.
+    for (i = 0; i < n; i++) {
+        struct qemu_romfile_s *qfile = files[i];
+        qemu_cfg_read_file(&qfile->file, buf, qfile->file.size);
+        qfile->data = buf;
+        buf += ALIGN(qfile->file.size, 4);
+    }
+    dprintf(3, "fw_cfg: prefetched %d files (%d bytes)\n", n, total);
+}
+
 u16
 qemu_get_romfile_key(struct romfile_s *file)
 {
@@ -712,11 +794,10 @@ static int qemu_cfg_detect(void)
     olly_printf("0----------qemu_cfg_detect\n");
     qemu_cfg_select(QEMU_CFG_SIGNATURE);  //向0x510端口写入全0
     olly_printf("1----------qemu_cfg_detect\n");
-    char *sig = "QEMU";
-    int i;
-    for (i = 0; i < 4; i++)
-        if (inb(PORT_QEMU_CFG_DATA) != sig[i]) /* 从端口0x510读取 */
-            return 0;
+    char sig[4];
+    insb(PORT_QEMU_CFG_DATA, (u8*)sig, sizeof(sig)); /* 从端口0x511读取 */
+    if (memcmp(sig, "QEMU", sizeof(sig)) != 0)
+        return 0;
 
     dprintf(1, "Found QEMU fw_cfg\n");
     cfg_enabled = 1;
@@ -733,6 +814,16 @@ static int qemu_cfg_detect(void)
     return 1;
 }
 
+// Small files that are read during POST anyway.
+static const char * const QemuCfgPrefetchFiles[] = {
+    "bootorder", "bios-geometry", "etc/boot-menu-wait", "etc/boot-fail-wait",
+    "etc/boot-menu-key", "etc/boot-menu-message", "etc/threads",
+    "etc/probe-threads", "etc/thread-stacks", "etc/usb-time-sigatt",
+    "etc/pci-optionrom-exec", "etc/optionroms-checksum",
+    "etc/extra-pci-roots", "etc/reserved-memory-end", "etc/pvpanic-port",
+    "etc/system-states", "etc/msr_feature_control", "etc/table-loader",
+};
+
 /*
  * handle_post()
  *  dopost()
@@ -756,13 +847,35 @@ void qemu_cfg_init(void)
     u32 count;
     qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
     count = be32_to_cpu(count);
+    // Read the whole directory in one transfer when possible.
+    struct QemuCfgFile *dir = NULL;
+    if (count) {
+        dir = malloc_tmp(count * sizeof(*dir));
+        if (dir)
+            qemu_cfg_read(dir, count * sizeof(*dir));
+        else
+            warn_noalloc();
+    }
     u32 e;
     for (e = 0; e < count; e++) {
-        struct QemuCfgFile qfile;
-        qemu_cfg_read(&qfile, sizeof(qfile));
-        qemu_romfile_add(qfile.name, be16_to_cpu(qfile.select)
-                         , 0, be32_to_cpu(qfile.size));
+        struct QemuCfgFile qfile, *f = &qfile;
+        if (dir)
+            f = &dir[e];
+        else
+            qemu_cfg_read(&qfile, sizeof(qfile));
+        qemu_romfile_add(f->name, be16_to_cpu(f->select)
+                         , 0, be32_to_cpu(f->size));
+    }
+    // Add decompressed views of "*.lz4" files (this reads their
+    // headers, so it can't be done while walking the directory).
+    for (e = 0; dir && e < count; e++) {
+        struct romfile_s *file = romfile_find(dir[e].name);
+        if (file)
+            romfile_add_lz4(file);
     }
+    free(dir);
+
+    qemu_cfg_prefetch(QemuCfgPrefetchFiles, ARRAY_SIZE(QemuCfgPrefetchFiles));
 
     qemu_cfg_e820();
 
@@ -777,7 +890,7 @@ void qemu_cfg_init(void)
     qemu_cfg_read_entry(&nogfx, QEMU_CFG_NOGRAPHIC, sizeof(nogfx));
     
     /*
-     * 到RomfileRoot中查找 "etc/sercon-port" 和 "vgaroms/sgabios.bin"
+     * 通过RomfileHash散列表查找 "etc/sercon-port" 和 "vgaroms/sgabios.bin"
      */
     if (nogfx && !romfile_find("etc/sercon-port")
         && !romfile_find("vgaroms/sgabios.bin"))
@@ -798,9 +911,9 @@ void qemu_cfg_init(void)
 static int qemu_early_e820(void)
 {
     struct e820_reservation table;
-    struct QemuCfgFile qfile;
+    struct QemuCfgFile qfile[4];
     u32 select = 0, size = 0;
-    u32 count, i;
+    u32 count, i, j;
 
     if (!qemu_cfg_detect()){
         return 0;
@@ -811,13 +924,19 @@ static int qemu_early_e820(void)
     qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
     
     count = be32_to_cpu(count);
-    for (i = 0; i < count; i++) {
-        qemu_cfg_read(&qfile, sizeof(qfile));
-        if (memcmp(qfile.name, "etc/e820", 9) != 0)
-            continue;
-        select = be16_to_cpu(qfile.select);
-        size = be32_to_cpu(qfile.size);
-        break;
+    // 每次读取ARRAY_SIZE(qfile)个目录项, 减少fw_cfg访问次数
+    for (i = 0; i < count && !select; i += j) {
+        u32 n = count - i;
+        if (n > ARRAY_SIZE(qfile))
+            n = ARRAY_SIZE(qfile);
+        qemu_cfg_read(qfile, n * sizeof(qfile[0]));
+        for (j = 0; j < n; j++) {
+            if (memcmp(qfile[j].name, "etc/e820", 9) != 0)
+                continue;
+            select = be16_to_cpu(qfile[j].select);
+            size = be32_to_cpu(qfile[j].size);
+            break;
+        }
     }
 //outb(select, 0x989);    
     if (select == 0) {
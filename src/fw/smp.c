@@ -7,6 +7,7 @@
 
 #include "config.h" // CONFIG_*
 #include "hw/rtc.h" // CMOS_BIOS_SMP_COUNT
+#include "malloc.h" // memalign_tmphigh
 #include "output.h" // dprintf
 #include "romfile.h" // romfile_loadint
 #include "stacks.h" // yield
@@ -78,7 +79,9 @@ apic_id_init(void)
     u32 apic_id = ebx>>24;
     if (MaxCountCPUs < 256) { // xAPIC mode
         // Track found apic id for use in legacy internal bios tables
-        FoundAPICIDs[apic_id/32] |= 1 << (apic_id % 32);
+        asm volatile("lock orl %1, %0"
+                     : "+m" (FoundAPICIDs[apic_id/32])
+                     : "r" (1 << (apic_id % 32)) : "memory");
     } else if (ecx & CPUID_X2APIC) {
         // switch to x2APIC mode
         u64 apic_base = rdmsr(MSR_IA32_APIC_BASE);
@@ -91,6 +94,31 @@ apic_id_init(void)
     return apic_id;
 }
 
+
+/*
+ * entry_smp中每个AP用lock xadd从SMPStackNext领取一个序号, 序号小于
+ * SMPStackCount的AP使用SMPStacks中自己的栈, 互不等待; 其余的AP仍然
+ * 通过SMPLock轮流使用BSP让出的SMPStack
+ */
+// Private bring-up stacks, one per AP.
+u32 SMPStacks __VISIBLE;
+u32 SMPStackCount __VISIBLE;
+u32 SMPStackNext __VISIBLE;
+// Permanent (smaller) set of stacks used by smp_resume().
+static u32 SMPResumeStacks, SMPResumeStackCount;
+#define SMP_RESUME_STACKS 16
+
+// Atomic lock for shared stack across processors.
+u32 SMPLock __VISIBLE;
+u32 SMPStack __VISIBLE;
+
+static u32
+smp_xadd(u32 *val, u32 add)
+{
+    asm volatile("lock xaddl %0, %1" : "+r" (add), "+m" (*val) : : "memory");
+    return add;
+}
+
 void VISIBLE32FLAT
 handle_smp(void)
 {
@@ -99,17 +127,15 @@ handle_smp(void)
 
     // Track this CPU and detect the apic_id
     int apic_id = apic_id_init();
+    // APs no longer take turns here, so this is only printed by verbose
+    // builds - the lines from many cpus interleave.
     dprintf(DEBUG_HDL_smp, "handle_smp: apic_id=0x%x\n", apic_id);
 
     smp_write_msrs();
 
-    CountCPUs++;
+    smp_xadd(&CountCPUs, 1);
 }
 
-// Atomic lock for shared stack across processors.
-u32 SMPLock __VISIBLE;
-u32 SMPStack __VISIBLE;
-
 /*
  * handle_post()
  *  dopost()
@@ -155,8 +181,10 @@ smp_scan(void)
     /* Set LINT1 as NMI, level triggered */
     writel(APIC_LINT1, 0x8400);
 
-    // Init the lock.
+    // Init the lock and the private stack counter.
     writel(&SMPLock, 1);
+    writel(&SMPStackNext, 0);
+    u64 start = rdtscll();
 
     // broadcast SIPI
     barrier();
@@ -168,9 +196,15 @@ smp_scan(void)
     // x2APIC and xAPIC mode could share AP wake up code
     apic_id_init();
 
-    // Wait for other CPUs to process the SIPI.
+    // Wait for other CPUs to process the SIPI.  CPUs with a private
+    // stack check in on their own; the shared stack only needs to be
+    // handed out once those run out.
     u16 expected_cpus_count = qemu_get_present_cpus_count();
-    while (expected_cpus_count != CountCPUs)
+    while (expected_cpus_count != readl(&CountCPUs)) {
+        if (readl(&SMPStackNext) <= SMPStackCount) {
+            asm volatile("rep ; nop");
+            continue;
+        }
         asm volatile(
             // Release lock and allow other processors to use the stack.
             "  movl %%esp, %1\n"
@@ -181,6 +215,8 @@ smp_scan(void)
             "  jc 1b\n"
             : "+m" (SMPLock), "+m" (SMPStack)
             : : "cc", "memory");
+    }
+    u64 end = rdtscll();
     yield();
 
     // Restore memory.
@@ -188,6 +224,12 @@ smp_scan(void)
 
     dprintf(1, "Found %d cpu(s) max supported %d cpu(s)\n", CountCPUs,
             MaxCountCPUs);
+    u64 cycles = end - start;
+    if (cycles > 0xffffffff)
+        cycles = 0xffffffff;
+    u32 shared = SMPStackNext > SMPStackCount ? SMPStackNext - SMPStackCount : 0;
+    dprintf(1, "smp: %d ap(s) started in %u kcycles (%d on the shared stack)\n"
+            , CountCPUs - 1, (u32)cycles / 1000, shared);
 }
 
 /*
@@ -210,9 +252,42 @@ smp_setup(void)
     if (MaxCountCPUs < smp_count)
         MaxCountCPUs = smp_count;
 
+    // Give each AP its own bring-up stack.  Only a few of them are
+    // kept for smp_resume(); any others use the shared stack there.
+    u32 aps = smp_count ? smp_count - 1 : 0;
+    if (aps) {
+        SMPStacks = (u32)memalign_tmphigh(16, aps * BUILD_AP_STACK_SIZE);
+        if (SMPStacks)
+            SMPStackCount = aps;
+        else
+            warn_noalloc();
+        u32 resume = aps < SMP_RESUME_STACKS ? aps : SMP_RESUME_STACKS;
+        SMPResumeStacks = (u32)memalign_high(16, resume * BUILD_AP_STACK_SIZE);
+        if (SMPResumeStacks)
+            SMPResumeStackCount = resume;
+        else
+            warn_noalloc();
+    }
+
     smp_scan();
 }
 
+/*
+ * handle_post()
+ *  dopost()
+ *   reloc_preinit(f==maininit)
+ *    maininit()
+ *     prepareboot()
+ *      smp_prepboot()
+ */
+// The private bring-up stacks are temporary - switch to the resume set.
+void
+smp_prepboot(void)
+{
+    SMPStacks = SMPResumeStacks;
+    SMPStackCount = SMPResumeStackCount;
+}
+
 void
 smp_resume(void)
 {
@@ -24,6 +24,8 @@
 #define AHCI_RESET_TIMEOUT     500 // 500 miliseconds
 #define AHCI_LINK_TIMEOUT       10 // 10 miliseconds
 
+#define AHCI_NCQ_MIN_SECTORS     8 // smallest chunk given its own NCQ tag
+
 // prepare sata command fis
 static void sata_prep_simple(struct sata_cmd_fis *fis, u8 command)
 {
@@ -60,6 +62,24 @@ static void sata_prep_readwrite(struct sata_cmd_fis *fis,
     fis->device       = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 }
 
+static void sata_prep_ncq(struct sata_cmd_fis *fis, u64 lba, u16 count,
+                          u8 tag, int iswrite)
+{
+    memset_fl(fis, 0, sizeof(*fis));
+    fis->command      = (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED
+                         : ATA_CMD_READ_FPDMA_QUEUED);
+    fis->feature      = count;
+    fis->feature2     = count >> 8;
+    fis->sector_count = tag << 3;
+    fis->lba_low      = lba;
+    fis->lba_mid      = lba >> 8;
+    fis->lba_high     = lba >> 16;
+    fis->lba_low2     = lba >> 24;
+    fis->lba_mid2     = lba >> 32;
+    fis->lba_high2    = lba >> 40;
+    fis->device       = ATA_CB_DH_LBA;
+}
+
 static void sata_prep_atapi(struct sata_cmd_fis *fis, u16 blocksize)
 {
     memset_fl(fis, 0, sizeof(*fis));
@@ -100,16 +120,13 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
-// submit ahci command + wait for result
-static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
-                        void *buffer, u32 bsize)
+// fill in the command header and prd table of a command slot
+static void ahci_prep_slot(struct ahci_port_s *port_gf, int slot, int iswrite,
+                           int isatapi, void *buffer, u32 bsize)
 {
-    u32 val, status, success, flags, intbits, error;
-    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
-    struct ahci_cmd_s  *cmd  = port_gf->cmd;
-    struct ahci_fis_s  *fis  = port_gf->fis;
+    struct ahci_cmd_s  *cmd  = &port_gf->cmd[slot];
     struct ahci_list_s *list = port_gf->list;
-    u32 pnr                  = port_gf->pnr;
+    u32 flags;
 
     cmd->fis.reg       = 0x27;
     cmd->fis.pmp_type  = 1 << 7; /* cmd fis */
@@ -121,10 +138,75 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
              (iswrite ? (1 << 6) : 0) |
              (isatapi ? (1 << 5) : 0) |
              (5 << 0)); /* fis length (dwords) */
-    list[0].flags  = flags;
-    list[0].bytes  = 0;
-    list[0].base   = (u32)(cmd);
-    list[0].baseu  = 0;
+    list[slot].flags  = flags;
+    list[slot].bytes  = 0;
+    list[slot].base   = (u32)(cmd);
+    list[slot].baseu  = 0;
+}
+
+// append another prd entry to a prepared command slot
+static void ahci_slot_add_prd(struct ahci_port_s *port_gf, int slot,
+                              void *buffer, u32 bsize)
+{
+    struct ahci_cmd_s  *cmd  = &port_gf->cmd[slot];
+    struct ahci_list_s *list = &port_gf->list[slot];
+    u32 prd = list->flags >> 16;
+
+    cmd->prdt[prd].base  = (u32)buffer;
+    cmd->prdt[prd].baseu = 0;
+    cmd->prdt[prd].flags = bsize-1;
+    list->flags += 1 << 16;
+}
+
+// non-queued error recovery (AHCI 1.3 section 6.2.2.1)
+static void ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr)
+{
+    u32 val;
+
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
+        dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+        mdelay (1);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+}
+
+// submit the command prepared in slot 0 + wait for result
+static int ahci_issue_command(struct ahci_port_s *port_gf)
+{
+    u32 status, success, intbits, error;
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    struct ahci_fis_s  *fis  = port_gf->fis;
+    u32 pnr                  = port_gf->pnr;
 
     dprintf(8, "AHCI/%d: send cmd ...\n", pnr);
     intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
@@ -168,47 +250,19 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
     } else {
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
-
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
-
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
-
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
-
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
-
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
-        }
-
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        ahci_port_recover(ctrl, pnr);
     }
     return success ? 0 : -1;
 }
 
+// submit ahci command + wait for result
+static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
+                        void *buffer, u32 bsize)
+{
+    ahci_prep_slot(port_gf, 0, iswrite, isatapi, buffer, bsize);
+    return ahci_issue_command(port_gf);
+}
+
 #define CDROM_CDB_SIZE 12
 
 int ahci_atapi_process_op(struct disk_op_s *op)
@@ -232,6 +286,79 @@ int ahci_atapi_process_op(struct disk_op_s *op)
     return DISK_RET_SUCCESS;
 }
 
+// read/write a request as several NCQ commands that are in flight together
+static int
+ahci_ncq_readwrite(struct disk_op_s *op, int iswrite)
+{
+    struct ahci_port_s *port_gf = container_of(
+        op->drive_fl, struct ahci_port_s, drive);
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr = port_gf->pnr;
+    u32 count = op->count;
+    u32 slots = DIV_ROUND_UP(count, AHCI_NCQ_MIN_SECTORS);
+    if (slots > port_gf->ncq_slots)
+        slots = port_gf->ncq_slots;
+    u32 chunk = DIV_ROUND_UP(count, slots);
+    slots = DIV_ROUND_UP(count, chunk);
+
+    u8 *buf = op->buf_fl;
+    u64 lba = op->lba;
+    u32 tag, mask = 0;
+    for (tag = 0; tag < slots; tag++) {
+        u32 blocks = count - tag * chunk;
+        if (blocks > chunk)
+            blocks = chunk;
+        sata_prep_ncq(&port_gf->cmd[tag].fis, lba, blocks, tag, iswrite);
+        ahci_prep_slot(port_gf, tag, iswrite, 0, buf,
+                       blocks * DISK_SECTOR_SIZE);
+        buf += blocks * DISK_SECTOR_SIZE;
+        lba += blocks;
+        mask |= 1 << tag;
+    }
+
+    dprintf(8, "AHCI/%d: send ncq cmds 0x%x ...\n", pnr, mask);
+    u32 intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    if (intbits)
+        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, mask);
+    ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, mask);
+
+    // The device clears a tag's SActive bit with a Set Device Bits FIS
+    // when that command completes, in whatever order it finishes them.
+    u32 end = timer_calc(AHCI_REQUEST_TIMEOUT);
+    u32 pending;
+    for (;;) {
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        pending = ahci_port_readl(ctrl, pnr, PORT_SCR_ACT) & mask;
+        if (intbits & PORT_IRQ_ERROR)
+            break;
+        if (!pending) {
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+            return DISK_RET_SUCCESS;
+        }
+        if (timer_check(end)) {
+            warn_timeout();
+            break;
+        }
+        yield();
+    }
+
+    dprintf(2, "AHCI/%d: ... ncq error, intbits 0x%x, pending 0x%x, tf 0x%x\n"
+            , pnr, intbits, pending, ahci_port_readl(ctrl, pnr, PORT_TFDATA));
+    // Report the blocks of the tags that completed before the first failure.
+    op->count = pending ? __ffs(pending) * chunk : 0;
+    ahci_port_recover(ctrl, pnr);
+
+    // Reading the NCQ command error log takes the device out of its
+    // queued error state (SATA 3.x section 13.6.3.2).
+    struct ahci_cmd_s *cmd = port_gf->cmd;
+    sata_prep_simple(&cmd->fis, ATA_CMD_READ_LOG_EXT);
+    cmd->fis.lba_low = 0x10;
+    cmd->fis.sector_count = 1;
+    ahci_command(port_gf, 0, 0, bounce_buf_fl, DISK_SECTOR_SIZE);
+    return DISK_RET_EBADTRACK;
+}
+
 // read/write count blocks from a harddrive, op->buf_fl must be word aligned
 static int
 ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
@@ -241,6 +368,9 @@ ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
     struct ahci_cmd_s *cmd = port_gf->cmd;
     int rc;
 
+    if (port_gf->ncq_slots && op->count >= 2 * AHCI_NCQ_MIN_SECTORS)
+        return ahci_ncq_readwrite(op, iswrite);
+
     sata_prep_readwrite(&cmd->fis, op, iswrite);
     rc = ahci_command(port_gf, iswrite, 0, op->buf_fl,
                       op->count * DISK_SECTOR_SIZE);
@@ -251,6 +381,63 @@ ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
     return DISK_RET_SUCCESS;
 }
 
+// write count blocks to a harddrive from a buffer at an odd address.
+// The caller's buffer is left untouched (it may not be writable), so
+// the data is copied through the bounce buffer a few sectors at a time.
+static int
+ahci_disk_write_unaligned(struct disk_op_s *op)
+{
+    struct disk_op_s localop = *op;
+    u8 *position = op->buf_fl;
+    u16 left = op->count;
+    u16 chunk = CDROM_SECTOR_SIZE / DISK_SECTOR_SIZE;
+
+    localop.buf_fl = bounce_buf_fl;
+    while (left) {
+        localop.count = left < chunk ? left : chunk;
+        memcpy(bounce_buf_fl, position, localop.count * DISK_SECTOR_SIZE);
+        int rc = ahci_disk_readwrite_aligned(&localop, 1);
+        if (rc)
+            return rc;
+        position += localop.count * DISK_SECTOR_SIZE;
+        localop.lba += localop.count;
+        left -= localop.count;
+    }
+    return DISK_RET_SUCCESS;
+}
+
+// read count blocks from a harddrive to a buffer at an odd address.
+// A prd entry must be word aligned, so the data is transferred one byte
+// above the caller's buffer, with the two bytes that don't fit going
+// through the bounce buffer, and is shifted into place afterwards.
+static int
+ahci_disk_read_unaligned(struct disk_op_s *op)
+{
+    struct ahci_port_s *port_gf = container_of(
+        op->drive_fl, struct ahci_port_s, drive);
+    u8 *buf = op->buf_fl;
+    u8 *tail = bounce_buf_fl;
+    u32 len = op->count * DISK_SECTOR_SIZE;
+    int rc;
+
+    if (!op->count)
+        return DISK_RET_SUCCESS;
+
+    sata_prep_readwrite(&port_gf->cmd->fis, op, 0);
+    ahci_prep_slot(port_gf, 0, 0, 0, buf + 1, len - 2);
+    ahci_slot_add_prd(port_gf, 0, tail, 2);
+    rc = ahci_issue_command(port_gf);
+    // Move the read data into place.
+    memmove(buf, buf + 1, len - 2);
+    memcpy(buf + len - 2, tail, 2);
+
+    dprintf(8, "ahci disk read, lba %6x, count %3x, buf %p (unaligned), rc %d\n",
+            (u32)op->lba, op->count, buf, rc);
+    if (rc < 0)
+        return DISK_RET_EBADTRACK;
+    return DISK_RET_SUCCESS;
+}
+
 // read/write count blocks from a harddrive.
 static int
 ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
@@ -258,38 +445,9 @@ ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
     // if caller's buffer is word aligned, use it directly
     if (((u32) op->buf_fl & 1) == 0)
         return ahci_disk_readwrite_aligned(op, iswrite);
-
-    // Use a word aligned buffer for AHCI I/O
-    int rc;
-    struct disk_op_s localop = *op;
-    u8 *alignedbuf_fl = bounce_buf_fl;
-    u8 *position = op->buf_fl;
-
-    localop.buf_fl = alignedbuf_fl;
-    localop.count = 1;
-
-    if (iswrite) {
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            memcpy_fl (alignedbuf_fl, position, DISK_SECTOR_SIZE);
-            rc = ahci_disk_readwrite_aligned (&localop, 1);
-            if (rc)
-                return rc;
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    } else { // read
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            rc = ahci_disk_readwrite_aligned (&localop, 0);
-            if (rc)
-                return rc;
-            memcpy_fl (position, alignedbuf_fl, DISK_SECTOR_SIZE);
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    }
-    return DISK_RET_SUCCESS;
+    if (iswrite)
+        return ahci_disk_write_unaligned(op);
+    return ahci_disk_read_unaligned(op);
 }
 
 // command demuxer
@@ -362,14 +520,14 @@ ahci_port_alloc(struct ahci_ctrl_s *ctrl, u32 pnr)
     port->ctrl = ctrl;
     port->list = memalign_tmp(1024, 1024);
     port->fis = memalign_tmp(256, 256);
-    port->cmd = memalign_tmp(256, 256);
+    port->cmd = memalign_tmp(256, sizeof(*port->cmd));
     if (port->list == NULL || port->fis == NULL || port->cmd == NULL) {
         warn_noalloc();
         return NULL;
     }
     memset(port->list, 0, 1024);
     memset(port->fis, 0, 256);
-    memset(port->cmd, 0, 256);
+    memset(port->cmd, 0, sizeof(*port->cmd));
 
     ahci_port_writel(ctrl, pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(ctrl, pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -412,7 +570,9 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
     free(port->cmd);
     port->list = memalign_high(1024, 1024);
     port->fis = memalign_high(256, 256);
-    port->cmd = memalign_high(256, 256);
+    // one command table per slot the port may have in flight
+    u32 slots = port->ncq_slots ? port->ncq_slots : 1;
+    port->cmd = memalign_high(256, slots * sizeof(*port->cmd));
     if (!port->list || !port->fis || !port->cmd) {
         warn_noalloc();
         free(port->list);
@@ -421,6 +581,7 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
         free(port);
         return NULL;
     }
+    memset(port->cmd, 0, slots * sizeof(*port->cmd));
 
     ahci_port_writel(port->ctrl, port->pnr, PORT_LST_ADDR, (u32)port->list);
     ahci_port_writel(port->ctrl, port->pnr, PORT_FIS_ADDR, (u32)port->fis);
@@ -602,6 +763,20 @@ static int ahci_port_setup(struct ahci_port_s *port)
         if (rc < 0) {
             dprintf(1, "AHCI/%d: Set transfer mode failed.\n", port->pnr);
         }
+
+        // word 76 bit 8 - NCQ support, word 75 - queue depth minus one
+        if ((ctrl->caps & HOST_CAP_NCQ) && buffer[76] != 0xffff
+            && (buffer[76] & (1 << 8))) {
+            u32 slots = HOST_CAP_NCS(ctrl->caps);
+            if (slots > (buffer[75] & 0x1f) + 1)
+                slots = (buffer[75] & 0x1f) + 1;
+            if (slots > AHCI_MAX_SLOTS)
+                slots = AHCI_MAX_SLOTS;
+            if (slots > 1) {
+                port->ncq_slots = slots;
+                dprintf(1, "AHCI/%d: NCQ with %d slots\n", port->pnr, slots);
+            }
+        }
     } else {
         // found cdrom (atapi)
         port->drive.type = DTYPE_AHCI_ATAPI;
@@ -730,7 +905,8 @@ ahci_controller_setup(struct pci_device *pci)
         port = ahci_port_alloc(ctrl, pnr);
         if (port == NULL)
             continue;
-        run_thread(ahci_port_detect, port);
+        run_probe(znprintf(MAXPROBEDESC, "AHCI/%d", pnr)
+                  , ahci_port_detect, port);
     }
     outl(ctrl->ports, 0x7315);
 }
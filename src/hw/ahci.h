@@ -36,6 +36,10 @@ struct ahci_ctrl_s {
     u32 ports;
 };
 
+#define AHCI_MAX_SLOTS     8  // command slots used per port with NCQ
+#define AHCI_MAX_PRDT      8  // prd entries per command table (256 bytes)
+
+/* command table, one per command slot */
 struct ahci_cmd_s {
     struct sata_cmd_fis fis;
     u8 atapi[0x20];
@@ -45,7 +49,7 @@ struct ahci_cmd_s {
         u32 baseu;
         u32 res;
         u32 flags;
-    } prdt[];
+    } prdt[AHCI_MAX_PRDT];
 };
 
 /* command list */
@@ -77,6 +81,7 @@ struct ahci_port_s {
     struct ahci_cmd_s  *cmd;
     u32                pnr;
     u32                atapi;
+    u32                ncq_slots;
     char               *desc;
     int                prio;
 };
@@ -109,6 +114,7 @@ int ahci_atapi_process_op(struct disk_op_s *op);
 #define HOST_CTL_AHCI_EN          (1 << 31) /* AHCI enabled */
 
 /* HOST_CAP bits */
+#define HOST_CAP_NCS(cap)         ((((cap) >> 8) & 0x1f) + 1) /* cmd slots */
 #define HOST_CAP_SSC              (1 << 14) /* Slumber capable */
 #define HOST_CAP_AHCI             (1 << 18) /* AHCI only */
 #define HOST_CAP_CLO              (1 << 24) /* Command List Override support */
@@ -955,7 +955,7 @@ init_controller(struct pci_device *pci, int chanid, int irq
     chan_gf->iomaster = master;
     dprintf(1, "ATA controller %d at %x/%x/%x (irq %d dev %x)\n"
             , ataid, port1, port2, master, irq, chan_gf->pci_bdf);
-    run_thread(ata_detect, chan_gf);
+    run_probe(znprintf(MAXPROBEDESC, "ata%d", ataid), ata_detect, chan_gf);
 }
 
 #define IRQ_ATA1 14
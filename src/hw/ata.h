@@ -120,6 +120,8 @@ void ata_setup(void);
 #define ATA_CMD_READ_VERIFY_SECTORS          0x40
 #define ATA_CMD_READ_VERIFY_SECTORS_EXT      0x42
 #define ATA_CMD_FORMAT_TRACK                 0x50
+#define ATA_CMD_READ_FPDMA_QUEUED            0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED           0x61
 #define ATA_CMD_SEEK                         0x70
 #define ATA_CMD_CFA_TRANSLATE_SECTOR         0x87
 #define ATA_CMD_EXECUTE_DEVICE_DIAGNOSTIC    0x90
@@ -238,6 +238,7 @@ esp_scsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_AMD
             || pci->device != PCI_DEVICE_ID_AMD_SCSI)
             continue;
-        run_thread(init_esp_scsi, pci);
+        run_probe(znprintf(MAXPROBEDESC, "esp-scsi %pP", pci)
+                  , init_esp_scsi, pci);
     }
 }
@@ -218,6 +218,7 @@ lsi_scsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_LSI_LOGIC
             || pci->device != PCI_DEVICE_ID_LSI_53C895A)
             continue;
-        run_thread(init_lsi_scsi, pci);
+        run_probe(znprintf(MAXPROBEDESC, "lsi-scsi %pP", pci)
+                  , init_lsi_scsi, pci);
     }
 }
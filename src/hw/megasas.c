@@ -401,6 +401,7 @@ megasas_setup(void)
             pci->device == PCI_DEVICE_ID_DELL_PERC5 ||
             pci->device == PCI_DEVICE_ID_LSI_SAS2208 ||
             pci->device == PCI_DEVICE_ID_LSI_SAS3108)
-            run_thread(init_megasas, pci);
+            run_probe(znprintf(MAXPROBEDESC, "megasas %pP", pci)
+                      , init_megasas, pci);
     }
 }
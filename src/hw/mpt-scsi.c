@@ -316,6 +316,7 @@ mpt_scsi_setup(void)
             && (pci->device == PCI_DEVICE_ID_LSI_53C1030
                 || pci->device == PCI_DEVICE_ID_LSI_SAS1068
                 || pci->device == PCI_DEVICE_ID_LSI_SAS1068E))
-            run_thread(init_mpt_scsi, pci);
+            run_probe(znprintf(MAXPROBEDESC, "mpt-scsi %pP", pci)
+                      , init_mpt_scsi, pci);
     }
 }
@@ -10,7 +10,12 @@
 #include "types.h" // u32
 #include "pcidevice.h" // struct pci_device
 
-#define NVME_MAX_PRPL_ENTRIES 15 /* Allows requests up to 64kb */
+/* Largest transfer described by a single command's PRP list */
+#define NVME_MAX_TRANSFER_SIZE (4 * 1024 * 1024)
+
+/* Most commands a request is split into and submitted with one doorbell
+   write - only requests larger than the per-command limit are split */
+#define NVME_MAX_BATCH 8
 
 /* Data structures */
 
@@ -123,10 +128,13 @@ struct nvme_namespace {
     /* Page aligned buffer of size NVME_PAGE_SIZE. */
     char *dma_buffer;
 
-    /* Page List */
+    /* Page List - page aligned, the last entry of a full page chains to
+       the next page */
     u32 prpl_len;
+    u32 prpl_entries;
     void *prp1;
-    u64 prpl[NVME_MAX_PRPL_ENTRIES];
+    void *prp2;
+    u64 *prpl;
 };
 
 /* Data structures for NVMe admin identify commands */
@@ -203,6 +211,9 @@ union nvme_identify {
 #define NVME_PAGE_SIZE 4096
 #define NVME_PAGE_MASK ~(NVME_PAGE_SIZE - 1)
 
+/* PRP entries that fit into one PRP list page. */
+#define NVME_PRPL_PAGE_ENTRIES (NVME_PAGE_SIZE / sizeof(u64))
+
 /* Length for the queue entries. */
 #define NVME_SQE_SIZE_LOG 6
 #define NVME_CQE_SIZE_LOG 4
@@ -84,6 +84,12 @@ nvme_poll_cq(struct nvme_cq *cq)
     return (!!(dw3 & NVME_CQE_DW3_P) == cq->phase);
 }
 
+static int
+nvme_cq_ready(void *data)
+{
+    return nvme_poll_cq(data);
+}
+
 static int
 nvme_is_cqe_success(struct nvme_cqe const *cqe)
 {
@@ -101,16 +107,12 @@ nvme_error_cqe(void)
     return r;
 }
 
-static struct nvme_cqe
-nvme_consume_cqe(struct nvme_sq *sq)
+/* Move past the completion queue entry at the head without telling the
+   controller. Returns the consumed entry. */
+static struct nvme_cqe *
+nvme_advance_cq(struct nvme_sq *sq)
 {
     struct nvme_cq *cq = sq->cq;
-
-    if (!nvme_poll_cq(cq)) {
-        /* Cannot consume a completion queue entry, if there is none ready. */
-        return nvme_error_cqe();
-    }
-
     struct nvme_cqe *cqe = &cq->cqe[cq->head];
     u16 cq_next_head = (cq->head + 1) & cq->common.mask;
     dprintf(4, "cq %p head %u -> %u\n", cq, cq->head, cq_next_head);
@@ -126,6 +128,21 @@ nvme_consume_cqe(struct nvme_sq *sq)
         dprintf(4, "sq %p advanced to %u\n", sq, cqe->sq_head);
     }
 
+    return cqe;
+}
+
+static struct nvme_cqe
+nvme_consume_cqe(struct nvme_sq *sq)
+{
+    struct nvme_cq *cq = sq->cq;
+
+    if (!nvme_poll_cq(cq)) {
+        /* Cannot consume a completion queue entry, if there is none ready. */
+        return nvme_error_cqe();
+    }
+
+    struct nvme_cqe *cqe = nvme_advance_cq(sq);
+
     /* Tell the controller that we consumed the completion. */
     writel(cq->common.dbl, cq->head);
 
@@ -137,16 +154,49 @@ nvme_wait(struct nvme_sq *sq)
 {
     static const unsigned nvme_timeout = 5000 /* ms */;
     u32 to = timer_calc(nvme_timeout);
-    while (!nvme_poll_cq(sq->cq)) {
-        yield();
+    if (yield_wait(nvme_cq_ready, sq->cq, to) < 0) {
+        warn_timeout();
+        return nvme_error_cqe();
+    }
 
-        if (timer_check(to)) {
+    return nvme_consume_cqe(sq);
+}
+
+/* Wait for the completions of count commands submitted with consecutive
+   command ids starting at first_cid. All entries that are ready are consumed
+   before the completion doorbell is written. Returns the index of the first
+   failed command, or count if all of them succeeded. */
+static int
+nvme_wait_batch(struct nvme_sq *sq, u16 first_cid, int count)
+{
+    static const unsigned nvme_timeout = 5000 /* ms */;
+    struct nvme_cq *cq = sq->cq;
+    u32 to = timer_calc(nvme_timeout);
+    int reaped = 0, failed = count;
+
+    while (reaped < count) {
+        if (yield_wait(nvme_cq_ready, cq, to) < 0) {
             warn_timeout();
-            return nvme_error_cqe();
+            return 0;
         }
+
+        do {
+            struct nvme_cqe *cqe = nvme_advance_cq(sq);
+            int idx = (cqe->cid - first_cid) & sq->common.mask;
+            if (!nvme_is_cqe_success(cqe) && idx < failed) {
+                dprintf(2, "batch io %d: %08x %08x %08x %08x\n", idx,
+                        cqe->dword[0], cqe->dword[1], cqe->dword[2],
+                        cqe->dword[3]);
+                failed = idx;
+            }
+            reaped++;
+        } while (reaped < count && nvme_poll_cq(cq));
+
+        /* Tell the controller that we consumed the completions. */
+        writel(cq->common.dbl, cq->head);
     }
 
-    return nvme_consume_cqe(sq);
+    return failed;
 }
 
 /* Returns the next submission queue entry (or NULL if the queue is full). It
@@ -154,7 +204,7 @@ nvme_wait(struct nvme_sq *sq)
 static struct nvme_sqe *
 nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data, void *data2)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full\n");
         return NULL;
     }
@@ -171,15 +221,30 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data, void *
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Queue an sqe that you've got from nvme_get_next_sqe without notifying the
+   controller yet. */
 static void
-nvme_commit_sqe(struct nvme_sq *sq)
+nvme_queue_sqe(struct nvme_sq *sq)
 {
-    dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
+    dprintf(4, "sq %p queue_sqe %u\n", sq, sq->tail);
     sq->tail = (sq->tail + 1) & sq->common.mask;
+}
+
+/* Tell the controller about all queued sqes. */
+static void
+nvme_ring_sq(struct nvme_sq *sq)
+{
     writel(sq->common.dbl, sq->tail);
 }
 
+/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+static void
+nvme_commit_sqe(struct nvme_sq *sq)
+{
+    nvme_queue_sqe(sq);
+    nvme_ring_sq(sq);
+}
+
 /* Perform an identify command on the admin queue and return the resulting
    buffer. This may be a NULL pointer, if something failed. This function
    cannot be used after initialization, because it uses buffers in tmp zone. */
@@ -286,15 +351,26 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, u32 ns_idx, u8 mdts)
     ns->drive.blksize   = ns->block_size;
     ns->drive.sectors   = ns->lba_count;
 
-    if (mdts) {
-        ns->max_req_size = ((1U << mdts) * NVME_PAGE_SIZE) / ns->block_size;
-        dprintf(3, "NVME NS %u max request size: %d sectors\n",
-                ns_id, ns->max_req_size);
-    } else {
-        ns->max_req_size = -1U;
-    }
-
+    u32 max_transfer = NVME_MAX_TRANSFER_SIZE;
+    if (mdts && mdts < 20 && (1U << mdts) * NVME_PAGE_SIZE < max_transfer)
+        max_transfer = (1U << mdts) * NVME_PAGE_SIZE;
+    ns->max_req_size = max_transfer / ns->block_size;
+    dprintf(3, "NVME NS %u max request size: %d sectors\n",
+            ns_id, ns->max_req_size);
+
+    /* Every list page but the last gives up one entry to chain the next. */
+    u32 prpl_pages = DIV_ROUND_UP(max_transfer / NVME_PAGE_SIZE,
+                                  NVME_PRPL_PAGE_ENTRIES - 1);
+    ns->prpl = zalloc_page_aligned(&ZoneHigh, prpl_pages * NVME_PAGE_SIZE);
+    ns->prpl_entries = prpl_pages * NVME_PRPL_PAGE_ENTRIES;
     ns->dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    if (!ns->prpl || !ns->dma_buffer) {
+        warn_noalloc();
+        free(ns->prpl);
+        free(ns->dma_buffer);
+        free(ns);
+        goto free_buffer;
+    }
 
     char *desc = znprintf(MAXDESCSIZE, "NVMe NS %u: %llu MiB (%llu %u-byte "
                           "blocks + %u-byte metadata)",
@@ -414,6 +490,25 @@ err:
     return -1;
 }
 
+/* Fill out a read or write command for count sectors described by prp1 and
+   prp2. Returns NULL if the submission queue is full. */
+static struct nvme_sqe *
+nvme_io_sqe(struct nvme_namespace *ns, u64 lba, void *prp1, void *prp2,
+            u16 count, int write)
+{
+    struct nvme_sqe *io_rw = nvme_get_next_sqe(&ns->ctrl->io_sq,
+                                               write ? NVME_SQE_OPC_IO_WRITE
+                                                     : NVME_SQE_OPC_IO_READ,
+                                               NULL, prp1, prp2);
+    if (!io_rw)
+        return NULL;
+    io_rw->nsid = ns->ns_id;
+    io_rw->dword[10] = (u32)lba;
+    io_rw->dword[11] = (u32)(lba >> 32);
+    io_rw->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
+    return io_rw;
+}
+
 /* Reads count sectors into buf. Returns DISK_RET_*. The buffer cannot cross
    page boundaries. */
 static int
@@ -421,7 +516,6 @@ nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
                   int write)
 {
     u32 buf_addr = (u32)buf;
-    void *prp2;
 
     if (buf_addr & 0x3) {
         /* Buffer is misaligned */
@@ -429,26 +523,11 @@ nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
         return DISK_RET_EBADTRACK;
     }
 
-    if ((ns->block_size * count) > (NVME_PAGE_SIZE * 2)) {
-        /* We need to describe more than 2 pages, rely on PRP List */
-        prp2 = ns->prpl;
-    } else if ((ns->block_size * count) > NVME_PAGE_SIZE) {
-        /* Directly embed the 2nd page if we only need 2 pages */
-        prp2 = (void *)(long)ns->prpl[0];
-    } else {
-        /* One page is enough, don't expose anything else */
-        prp2 = NULL;
+    if (!nvme_io_sqe(ns, lba, buf, NULL, count, write)) {
+        warn_internalerror();
+        return DISK_RET_EBADTRACK;
     }
 
-    struct nvme_sqe *io_read = nvme_get_next_sqe(&ns->ctrl->io_sq,
-                                                 write ? NVME_SQE_OPC_IO_WRITE
-                                                       : NVME_SQE_OPC_IO_READ,
-                                                 NULL, buf, prp2);
-    io_read->nsid = ns->ns_id;
-    io_read->dword[10] = (u32)lba;
-    io_read->dword[11] = (u32)(lba >> 32);
-    io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
-
     nvme_commit_sqe(&ns->ctrl->io_sq);
 
     struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
@@ -468,56 +547,117 @@ static void nvme_reset_prpl(struct nvme_namespace *ns)
     ns->prpl_len = 0;
 }
 
-static int nvme_add_prpl(struct nvme_namespace *ns, u64 base)
+static int nvme_add_prpl(struct nvme_namespace *ns, u64 base, int last)
 {
-    if (ns->prpl_len >= NVME_MAX_PRPL_ENTRIES)
+    u32 slot = ns->prpl_len;
+
+    if (slot % NVME_PRPL_PAGE_ENTRIES == NVME_PRPL_PAGE_ENTRIES - 1 && !last) {
+        /* This list page is full, link it to the next one */
+        if (slot + 1 >= ns->prpl_entries)
+            return -1;
+        ns->prpl[slot] = (u32)&ns->prpl[slot + 1];
+        slot++;
+    }
+    if (slot >= ns->prpl_entries)
         return -1;
 
-    ns->prpl[ns->prpl_len++] = base;
+    ns->prpl[slot] = base;
+    ns->prpl_len = slot + 1;
 
     return 0;
 }
 
+/* Describe count blocks at op_buf with prp1/prp2, appending to the PRP list
+   entries already used by other commands of the same batch. Returns the
+   number of blocks described, 0 if the buffer can't be mapped directly. */
 static int nvme_build_prpl(struct nvme_namespace *ns, void *op_buf, u16 count)
 {
-    int first_page = 1;
     u32 base = (long)op_buf;
+    u32 start = ns->prpl_len;
     s32 size;
 
     if (count > ns->max_req_size)
         count = ns->max_req_size;
 
-    nvme_reset_prpl(ns);
+    /* PRP entries have to be dword aligned */
+    if (base & 0x3)
+        return 0;
 
     size = count * ns->block_size;
     /* Special case for transfers that fit into PRP1, but are unaligned */
     if (((size + (base & ~NVME_PAGE_MASK)) <= NVME_PAGE_SIZE)) {
         ns->prp1 = op_buf;
+        ns->prp2 = NULL;
         return count;
     }
 
-    /* Every request has to be page aligned */
-    if (base & ~NVME_PAGE_MASK)
-        return 0;
-
-    /* Make sure a full block fits into the last chunk */
-    if (size & (ns->block_size - 1ULL))
-        return 0;
-
+    /* PRP1 may start anywhere in the first page, the list entries cover
+       the following pages from their start */
+    ns->prp1 = op_buf;
+    size -= NVME_PAGE_SIZE - (base & ~NVME_PAGE_MASK);
+    base = (base & NVME_PAGE_MASK) + NVME_PAGE_SIZE;
     for (; size > 0; base += NVME_PAGE_SIZE, size -= NVME_PAGE_SIZE) {
-        if (first_page) {
-            /* First page is special */
-            ns->prp1 = (void*)base;
-            first_page = 0;
-            continue;
-        }
-        if (nvme_add_prpl(ns, base))
+        if (nvme_add_prpl(ns, base, size <= NVME_PAGE_SIZE))
             return 0;
     }
 
+    if (ns->prpl_len - start == 1) {
+        /* Directly embed the 2nd page if we only need 2 pages */
+        ns->prp2 = (void *)(u32)ns->prpl[start];
+        ns->prpl_len = start;
+    } else {
+        /* We need to describe more than 2 pages, rely on PRP List */
+        ns->prp2 = &ns->prpl[start];
+    }
+
     return count;
 }
 
+/* Submit the buffer as read/write commands of up to the per-command limit
+   (MDTS), at most NVME_MAX_BATCH of them, with a single doorbell write and
+   reap their completions together. A request within the limit is sent as
+   a single command. Returns the
+   number of blocks transferred (0 if the buffer can't be mapped directly)
+   and stores the DISK_RET_* status in res. */
+static u16
+nvme_io_batch(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+              int write, int *res)
+{
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
+    u16 cmd_blocks[NVME_MAX_BATCH];
+    u16 first_cid = sq->tail, done = 0;
+    int cmds = 0;
+
+    /* nvme_build_prpl() limits each command to what one command may
+       transfer, so only requests beyond that are split. */
+    nvme_reset_prpl(ns);
+    while (done < count && cmds < NVME_MAX_BATCH) {
+        u16 blocks = nvme_build_prpl(ns, buf + done * ns->block_size,
+                                     count - done);
+        if (!blocks)
+            break;
+        if (!nvme_io_sqe(ns, lba + done, ns->prp1, ns->prp2, blocks, write))
+            break;
+        nvme_queue_sqe(sq);
+        cmd_blocks[cmds++] = blocks;
+        done += blocks;
+    }
+    if (!cmds)
+        return 0;
+
+    nvme_ring_sq(sq);
+    int failed = nvme_wait_batch(sq, first_cid, cmds);
+
+    dprintf(5, "ns %u %s lba %llu+%u: %d commands\n", ns->ns_id,
+            write ? "write" : "read", lba, done, cmds);
+
+    *res = failed < cmds ? DISK_RET_EBADTRACK : DISK_RET_SUCCESS;
+    int i;
+    for (i = 0, done = 0; i < failed; i++)
+        done += cmd_blocks[i];
+    return done;
+}
+
 static int
 nvme_create_io_queues(struct nvme_ctrl *ctrl)
 {
@@ -620,6 +760,7 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
             identify->nn, (identify->nn == 1) ? "" : "s");
 
     ctrl->ns_count = identify->nn;
+    u8 mdts = identify->mdts;
     free(identify);
 
     if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
@@ -631,7 +772,7 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
     /* Populate namespace IDs */
     int ns_idx;
     for (ns_idx = 0; ns_idx < ctrl->ns_count; ns_idx++) {
-        nvme_probe_ns(ctrl, ns_idx, identify->mdts);
+        nvme_probe_ns(ctrl, ns_idx, mdts);
     }
 
     dprintf(3, "NVMe initialization complete!\n");
@@ -709,7 +850,8 @@ nvme_scan(void)
             continue;
         }
 
-        run_thread(nvme_controller_setup, pci);
+        run_probe(znprintf(MAXPROBEDESC, "nvme %pP", pci)
+                  , nvme_controller_setup, pci);
     }
 }
 
@@ -724,13 +866,9 @@ nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
         u16 blocks_remaining = op->count - i;
         char *op_buf = op->buf_fl + i * ns->block_size;
 
-        blocks = nvme_build_prpl(ns, op_buf, blocks_remaining);
-        if (blocks) {
-            res = nvme_io_readwrite(ns, op->lba + i, ns->prp1, blocks, write);
-            dprintf(5, "ns %u %s lba %llu+%u: %d\n", ns->ns_id, write ? "write"
-                                                                      : "read",
-                    op->lba, blocks, res);
-        } else {
+        blocks = nvme_io_batch(ns, op->lba + i, op_buf, blocks_remaining,
+                               write, &res);
+        if (!blocks && res == DISK_RET_SUCCESS) {
             blocks = blocks_remaining < max_blocks ? blocks_remaining
                                                    : max_blocks;
 
@@ -329,6 +329,7 @@ pvscsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_VMWARE
             || pci->device != PCI_DEVICE_ID_VMWARE_PVSCSI)
             continue;
-        run_thread(init_pvscsi, pci);
+        run_probe(znprintf(MAXPROBEDESC, "pvscsi %pP", pci)
+                  , init_pvscsi, pci);
     }
 }
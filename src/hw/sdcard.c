@@ -564,7 +564,7 @@ sdcard_setup(void)
         file = romfile_findprefix("etc/sdcard", file);
         if (!file)
             break;
-        run_thread(sdcard_romfile_setup, file);
+        run_probe(file->name, sdcard_romfile_setup, file);
         num_romfiles++;
     }
     if (num_romfiles)
@@ -576,6 +576,7 @@ sdcard_setup(void)
         if (pci->class != PCI_CLASS_SYSTEM_SDHCI || pci->prog_if >= 2)
             // Not an SDHCI controller following SDHCI spec
             continue;
-        run_thread(sdcard_pci_setup, pci);
+        run_probe(znprintf(MAXPROBEDESC, "sdhci %pP", pci)
+                  , sdcard_pci_setup, pci);
     }
 }
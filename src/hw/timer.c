@@ -199,7 +199,7 @@ timer_adjust_bits(u32 value, u32 validbits)
 }
 
 // Sample the current timer value.
-static u32
+u32
 timer_read(void)
 {
     u16 port = GET_GLOBAL(TimerPort);
@@ -215,6 +215,14 @@ timer_read(void)
     return timer_adjust_bits(-v, 0xffff);
 }
 
+// Return the number of microseconds in 'ticks' timer_read() ticks.
+u32
+timer_ticks_to_us(u32 ticks)
+{
+    u32 khz = GET_GLOBAL(TimerKHz);
+    return (ticks / khz) * 1000 + (ticks % khz) * 1000 / khz;
+}
+
 // Return the TSC value that is 'msecs' time in the future.
 u32
 timer_calc(u32 msecs)
@@ -255,8 +263,7 @@ timer_delay(u32 end)
 static void
 timer_sleep(u32 end)
 {
-    while (!timer_check(end))
-        yield();
+    yield_wait(NULL, NULL, end);
 }
 
 void ndelay(u32 count) {
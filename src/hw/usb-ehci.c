@@ -321,7 +321,7 @@ ehci_controller_setup(struct pci_device *pci)
 
     // XXX - check for and disable SMM control?
 
-    run_thread(configure_ehci, cntl);
+    run_probe(znprintf(MAXPROBEDESC, "ehci %pP", pci), configure_ehci, cntl);
 }
 
 void
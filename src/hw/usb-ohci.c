@@ -292,7 +292,7 @@ ohci_controller_setup(struct pci_device *pci)
     writel(&cntl->regs->intrdisable, ~0);
     writel(&cntl->regs->intrstatus, ~0);
 
-    run_thread(configure_ohci, cntl);
+    run_probe(znprintf(MAXPROBEDESC, "ohci %pP", pci), configure_ohci, cntl);
 }
 
 void
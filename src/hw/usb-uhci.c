@@ -265,7 +265,7 @@ uhci_controller_setup(struct pci_device *pci)
 
     reset_uhci(cntl, pci->bdf);
 
-    run_thread(configure_uhci, cntl);
+    run_probe(znprintf(MAXPROBEDESC, "uhci %pP", pci), configure_uhci, cntl);
 }
 
 void
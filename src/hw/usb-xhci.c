@@ -293,16 +293,25 @@ static const int speed_to_xhci[] = {
     [ USB_SUPERSPEED ] = 4,
 };
 
+struct wait_bit_s {
+    u32 *reg;
+    u32 mask;
+    int value;
+};
+
+static int bit_ready(void *data)
+{
+    struct wait_bit_s *wb = data;
+    return (readl(wb->reg) & wb->mask) == wb->value;
+}
+
 static int wait_bit(u32 *reg, u32 mask, int value, u32 timeout)
 {
-    u32 end = timer_calc(timeout);
+    struct wait_bit_s wb = { reg, mask, value };
 
-    while ((readl(reg) & mask) != value) {
-        if (timer_check(end)) {
-            warn_timeout();
-            return -1;
-        }
-        yield();
+    if (yield_wait(bit_ready, &wb, timer_calc(timeout)) < 0) {
+        warn_timeout();
+        return -1;
     }
     return 0;
 }
@@ -634,7 +643,7 @@ xhci_controller_setup_pci(struct pci_device *pci)
         return;
 
     xhci->usb.pci = pci;
-    run_thread(configure_xhci, xhci);
+    run_probe(znprintf(MAXPROBEDESC, "xhci %pP", pci), configure_xhci, xhci);
 }
 
 static void
@@ -657,7 +666,8 @@ xhci_controller_setup_acpi(struct acpi_device *dev)
         return;
 
     xhci->usb.mmio = baseaddr;
-    run_thread(configure_xhci, xhci);
+    run_probe(znprintf(MAXPROBEDESC, "xhci %p", baseaddr)
+              , configure_xhci, xhci);
 }
 
 void
@@ -24,59 +24,136 @@
 #include "virtio-ring.h"
 #include "virtio-blk.h"
 
+// Maximum number of requests a single disk_op_s is split into
+#define VIRTIO_BLK_MAX_REQS 16
+// Number of sectors transferred by each request of a split disk_op_s
+#define VIRTIO_BLK_REQ_SECTORS 8
+// Descriptors used by one request (header, data, status)
+#define VIRTIO_BLK_REQ_DESCS 3
+// Maximum number of request queues used on multi-queue devices
+#define VIRTIO_BLK_MAX_QUEUES 4
+
+struct virtio_blk_req {
+    struct virtio_blk_outhdr hdr;
+    u8 status;
+};
+
+struct virtio_blk_queue {
+    struct vring_virtqueue *vq;
+    struct virtio_blk_req *reqs;
+    u16 max_reqs;
+    u8 busy;
+};
+
 struct virtiodrive_s {
     struct drive_s drive;
-    struct vring_virtqueue *vq;
     struct vp_device vp;
+    struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
+    u16 num_queues;
+    u16 next_queue;
 };
 
+// Claim an idle request queue, waiting for one if all are in use
+static struct virtio_blk_queue *
+virtio_blk_get_queue(struct virtiodrive_s *vdrive)
+{
+    for (;;) {
+        int i;
+        for (i = 0; i < vdrive->num_queues; i++) {
+            int q = (vdrive->next_queue + i) % vdrive->num_queues;
+            struct virtio_blk_queue *queue = &vdrive->queues[q];
+            if (!queue->busy) {
+                queue->busy = 1;
+                vdrive->next_queue = q + 1;
+                return queue;
+            }
+        }
+        yield();
+    }
+}
+
 static int
 virtio_blk_op(struct disk_op_s *op, int write)
 {
     struct virtiodrive_s *vdrive =
         container_of(op->drive_fl, struct virtiodrive_s, drive);
-    struct vring_virtqueue *vq = vdrive->vq;
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
-
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(&vdrive->vp, vq, 1);
-
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
-
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
+    u32 blksize = vdrive->drive.blksize;
+
+    int count = op->count, num_reqs = 0;
+    if (!count)
+        return DISK_RET_SUCCESS;
+    struct virtio_blk_queue *queue = virtio_blk_get_queue(vdrive);
+    struct vring_virtqueue *vq = queue->vq;
+    struct virtio_blk_req *reqs = queue->reqs;
+
+    // Split the request into several descriptor chains and submit
+    // them with a single notification.
+    int chunk = DIV_ROUND_UP(count, queue->max_reqs);
+    if (chunk < VIRTIO_BLK_REQ_SECTORS)
+        chunk = VIRTIO_BLK_REQ_SECTORS;
+    u64 lba = op->lba;
+    char *buf = op->buf_fl;
+    while (count > 0) {
+        int sectors = count < chunk ? count : chunk;
+        struct virtio_blk_req *req = &reqs[num_reqs];
+        req->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+        req->hdr.ioprio = 0;
+        req->hdr.sector = lba;
+        req->status = VIRTIO_BLK_S_UNSUPP;
+        struct vring_list sg[] = {
+            {
+                .addr       = (void*)(&req->hdr),
+                .length     = sizeof(req->hdr),
+            },
+            {
+                .addr       = buf,
+                .length     = blksize * sectors,
+            },
+            {
+                .addr       = (void*)(&req->status),
+                .length     = sizeof(req->status),
+            },
+        };
+
+        /* Add to virtqueue */
+        if (write)
+            vring_add_buf(vq, sg, 2, 1, num_reqs, num_reqs);
+        else
+            vring_add_buf(vq, sg, 1, 2, num_reqs, num_reqs);
+        num_reqs++;
+        lba += sectors;
+        buf += blksize * sectors;
+        count -= sectors;
+    }
+    vring_kick(&vdrive->vp, vq, num_reqs);
+
+    /* Wait for all replies and reclaim the virtqueue elements */
+    int pending = num_reqs;
+    while (pending) {
+        if (!vring_more_used(vq)) {
+            usleep(5);
+            continue;
+        }
+        vring_get_buf(vq, NULL);
+        pending--;
+    }
 
     /* Clear interrupt status register.  Avoid leaving interrupts stuck if
      * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
      */
     vp_get_isr(&vdrive->vp);
 
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    // Report the sectors transferred up to the first failed request
+    int i, ret = DISK_RET_SUCCESS;
+    for (i = 0; i < num_reqs; i++) {
+        if (reqs[i].status != VIRTIO_BLK_S_OK) {
+            op->count = i * chunk;
+            ret = DISK_RET_EBADTRACK;
+            break;
+        }
+    }
+    queue->busy = 0;
+    return ret;
 }
 
 int
@@ -94,6 +171,50 @@ virtio_blk_process_op(struct disk_op_s *op)
     }
 }
 
+// Set up the request queues and the per-request headers used to
+// split disk requests
+static int
+virtio_blk_init_queues(struct virtiodrive_s *vdrive, u16 num_queues)
+{
+    if (num_queues > VIRTIO_BLK_MAX_QUEUES)
+        num_queues = VIRTIO_BLK_MAX_QUEUES;
+    int i;
+    for (i = 0; i < num_queues; i++) {
+        struct virtio_blk_queue *queue = &vdrive->queues[i];
+        if (vp_find_vq(&vdrive->vp, i, &queue->vq) < 0)
+            break;
+        struct vring_virtqueue *vq = queue->vq;
+        u16 num = vq->use_packed ? vq->packed.num : vq->vring.num;
+        u16 max_reqs = num / VIRTIO_BLK_REQ_DESCS;
+        if (max_reqs > VIRTIO_BLK_MAX_REQS)
+            max_reqs = VIRTIO_BLK_MAX_REQS;
+        if (!max_reqs)
+            break;
+        queue->reqs = malloc_high(sizeof(*queue->reqs) * max_reqs);
+        if (!queue->reqs) {
+            warn_noalloc();
+            break;
+        }
+        queue->max_reqs = max_reqs;
+        vdrive->num_queues++;
+    }
+    if (!vdrive->num_queues)
+        return -1;
+    dprintf(3, "virtio-blk using %d of %d request queues\n",
+            vdrive->num_queues, num_queues);
+    return 0;
+}
+
+static void
+virtio_blk_free_queues(struct virtiodrive_s *vdrive)
+{
+    int i;
+    for (i = 0; i < VIRTIO_BLK_MAX_QUEUES; i++) {
+        free(vdrive->queues[i].reqs);
+        vring_free(vdrive->queues[i].vq);
+    }
+}
+
 static void
 init_virtio_blk(void *data)
 {
@@ -110,23 +231,21 @@ init_virtio_blk(void *data)
     vdrive->drive.cntl_id = pci->bdf;
 
     vp_init_simple(&vdrive->vp, pci);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
-        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
-        goto fail;
-    }
-
+    u16 num_queues = 1;
     if (vdrive->vp.use_modern) {
         struct vp_device *vp = &vdrive->vp;
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
+        u64 mq = 1ull << VIRTIO_BLK_F_MQ;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        features = features & (version1 | iommu_platform | blk_size);
+        features = features & (version1 | iommu_platform | blk_size | mq
+                               | VRING_FEATURES);
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -157,6 +276,9 @@ init_virtio_blk(void *data)
             vp_read(&vp->device, struct virtio_blk_config, heads);
         vdrive->drive.pchs.sector =
             vp_read(&vp->device, struct virtio_blk_config, sectors);
+        if (features & mq)
+            num_queues =
+                vp_read(&vp->device, struct virtio_blk_config, num_queues);
     } else {
         struct virtio_blk_config cfg;
         vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
@@ -164,6 +286,7 @@ init_virtio_blk(void *data)
         u64 f = vp_get_features(&vdrive->vp);
         vdrive->drive.blksize = (f & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
             cfg.blk_size : DISK_SECTOR_SIZE;
+        vp_set_features(&vdrive->vp, f & VRING_FEATURES);
 
         vdrive->drive.sectors = cfg.capacity;
         dprintf(3, "virtio-blk %pP blksize=%d sectors=%u\n",
@@ -179,6 +302,11 @@ init_virtio_blk(void *data)
         vdrive->drive.pchs.sector = cfg.sectors;
     }
 
+    if (virtio_blk_init_queues(vdrive, num_queues) < 0) {
+        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
+        goto fail;
+    }
+
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk PCI:%pP", pci);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_pci_device(pci));
 
@@ -190,7 +318,7 @@ init_virtio_blk(void *data)
 
 fail:
     vp_reset(&vdrive->vp);
-    free(vdrive->vq);
+    virtio_blk_free_queues(vdrive);
     free(vdrive);
 }
 
@@ -221,17 +349,13 @@ init_virtio_blk_mmio(void *mmio)
     vdrive->drive.cntl_id = (u32)mmio;
 
     vp_init_mmio(&vdrive->vp, mmio);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
-        dprintf(1, "fail to find vq for virtio-blk-mmio %p\n", mmio);
-        goto fail;
-    }
-
     struct vp_device *vp = &vdrive->vp;
     u64 features = vp_get_features(vp);
     u64 version1 = 1ull << VIRTIO_F_VERSION_1;
     u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
+    u64 mq = 1ull << VIRTIO_BLK_F_MQ;
 
-    features = features & (version1 | blk_size);
+    features = features & (version1 | blk_size | mq | VRING_FEATURES);
     vp_set_features(vp, features);
     status |= VIRTIO_CONFIG_S_FEATURES_OK;
     vp_set_status(vp, status);
@@ -263,6 +387,14 @@ init_virtio_blk_mmio(void *mmio)
     vdrive->drive.pchs.sector =
         vp_read(&vp->device, struct virtio_blk_config, sectors);
 
+    u16 num_queues = 1;
+    if (features & mq)
+        num_queues = vp_read(&vp->device, struct virtio_blk_config, num_queues);
+    if (virtio_blk_init_queues(vdrive, num_queues) < 0) {
+        dprintf(1, "fail to find vq for virtio-blk-mmio %p\n", mmio);
+        goto fail;
+    }
+
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk mmio:%p", mmio);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_mmio_device(mmio));
 
@@ -272,7 +404,7 @@ init_virtio_blk_mmio(void *mmio)
 
 fail:
     vp_reset(&vdrive->vp);
-    free(vdrive->vq);
+    virtio_blk_free_queues(vdrive);
     free(vdrive);
 }
 
@@ -300,6 +432,7 @@ virtio_blk_setup(void)
             continue;
         }
 
-        run_thread(init_virtio_blk, pci);
+        run_probe(znprintf(MAXPROBEDESC, "virtio-blk %pP", pci)
+                  , init_virtio_blk, pci);
     }
 }
@@ -14,9 +14,13 @@ struct virtio_blk_config
     u8 alignment_offset;
     u16 min_io_size;
     u32 opt_io_size;
+    u8 writeback;
+    u8 unused0;
+    u16 num_queues;
 } __attribute__((packed));
 
 #define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_MQ 12
 
 /* These two define direction. */
 #define VIRTIO_BLK_T_IN         0
@@ -96,10 +96,12 @@ void virtio_mmio_setup_one(u64 addr)
 
     switch (devid) {
     case 2: /* blk */
-        run_thread(init_virtio_blk_mmio, mmio);
+        run_probe(znprintf(MAXPROBEDESC, "virtio-blk %llx", addr)
+                  , init_virtio_blk_mmio, mmio);
         break;
     case 8: /* scsi */
-        run_thread(init_virtio_scsi_mmio, mmio);
+        run_probe(znprintf(MAXPROBEDESC, "virtio-scsi %llx", addr)
+                  , init_virtio_scsi_mmio, mmio);
         break;
     default:
         break;
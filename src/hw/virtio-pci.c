@@ -193,7 +193,8 @@ u64 vp_get_features(struct vp_device *vp)
     if (vp->use_mmio) {
         vp_write(&vp->common, virtio_mmio_cfg, device_feature_select, 0);
         f0 = vp_read(&vp->common, virtio_mmio_cfg, device_feature);
-        f1 = 0;
+        vp_write(&vp->common, virtio_mmio_cfg, device_feature_select, 1);
+        f1 = vp_read(&vp->common, virtio_mmio_cfg, device_feature);
     } else if (vp->use_modern) {
         vp_write(&vp->common, virtio_pci_common_cfg, device_feature_select, 0);
         f0 = vp_read(&vp->common, virtio_pci_common_cfg, device_feature);
@@ -210,12 +211,15 @@ void vp_set_features(struct vp_device *vp, u64 features)
 {
     u32 f0, f1;
 
+    vp->features = features;
     f0 = features;
     f1 = features >> 32;
 
     if (vp->use_mmio) {
-        vp_write(&vp->common, virtio_mmio_cfg, guest_feature_select, f0);
+        vp_write(&vp->common, virtio_mmio_cfg, guest_feature_select, 0);
         vp_write(&vp->common, virtio_mmio_cfg, guest_feature, f0);
+        vp_write(&vp->common, virtio_mmio_cfg, guest_feature_select, 1);
+        vp_write(&vp->common, virtio_mmio_cfg, guest_feature, f1);
     } else if (vp->use_modern) {
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature_select, 0);
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature, f0);
@@ -375,7 +379,19 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
 
    /* initialize the queue */
    struct vring * vr = &vq->vring;
-   vring_init(vr, num, (unsigned char*)&vq->queue);
+   void *desc, *driver, *device;
+   if (vp->features & (1ull << VIRTIO_F_RING_PACKED)) {
+       vring_init_packed(vq, num);
+       desc = vq->packed.desc;
+       driver = vq->packed.driver;
+       device = vq->packed.device;
+   } else {
+       vring_init(vr, num, (unsigned char*)&vq->queue);
+       desc = vr->desc;
+       driver = vr->avail;
+       device = vr->used;
+   }
+   vring_init_features(vq, vp->features);
 
    /* activate the queue
     *
@@ -385,13 +401,13 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
    if (vp->use_mmio) {
        if (vp_read(&vp->common, virtio_mmio_cfg, version) == 2) {
            vp_write(&vp->common, virtio_mmio_cfg, queue_desc_lo,
-                    (unsigned long)virt_to_phys(vr->desc));
+                    (unsigned long)virt_to_phys(desc));
            vp_write(&vp->common, virtio_mmio_cfg, queue_desc_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_driver_lo,
-                    (unsigned long)virt_to_phys(vr->avail));
+                    (unsigned long)virt_to_phys(driver));
            vp_write(&vp->common, virtio_mmio_cfg, queue_driver_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_device_lo,
-                    (unsigned long)virt_to_phys(vr->used));
+                    (unsigned long)virt_to_phys(device));
            vp_write(&vp->common, virtio_mmio_cfg, queue_device_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_ready, 1);
        } else {
@@ -402,13 +418,13 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
        }
    } else if (vp->use_modern) {
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_lo,
-                (unsigned long)virt_to_phys(vr->desc));
+                (unsigned long)virt_to_phys(desc));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_lo,
-                (unsigned long)virt_to_phys(vr->avail));
+                (unsigned long)virt_to_phys(driver));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_lo,
-                (unsigned long)virt_to_phys(vr->used));
+                (unsigned long)virt_to_phys(device));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_enable, 1);
        vq->queue_notify_off = vp_read(&vp->common, virtio_pci_common_cfg,
@@ -109,6 +109,7 @@ struct vp_cap {
 
 struct vp_device {
     struct vp_cap common, notify, isr, device, legacy;
+    u64 features;
     u32 notify_off_multiplier;
     u8 use_modern;
     u8 use_mmio;
@@ -16,6 +16,7 @@
  *
  */
 
+#include "malloc.h" // memalign_high
 #include "output.h" // panic
 #include "virtio-ring.h"
 #include "virtio-pci.h"
@@ -25,6 +26,48 @@
         } while (0)
 #define BUG_ON(condition) do { if (condition) BUG(); } while (0)
 
+/*
+ * vring_init_features
+ *
+ * enable the ring features negotiated with the device
+ *
+ */
+
+void vring_init_features(struct vring_virtqueue *vq, u64 features)
+{
+    ASSERT32FLAT();
+    vq->event_idx = !!(features & (1ull << VIRTIO_RING_F_EVENT_IDX));
+    if (vq->event_idx && !vq->use_packed)
+        /* Polled queue - keep the used event out of reach. */
+        vring_used_event(&vq->vring) = vq->last_used_idx + 0x8000;
+
+    if (!(features & (1ull << VIRTIO_RING_F_INDIRECT_DESC)) || vq->indirect)
+        return;
+    vq->indirect = memalign_high(sizeof(struct vring_desc),
+                                 sizeof(struct vring_desc)
+                                 * VRING_INDIRECT_TABLES * VRING_INDIRECT_MAX);
+    if (!vq->indirect) {
+        warn_noalloc();
+        return;
+    }
+    vq->indirect_free = (1 << VRING_INDIRECT_TABLES) - 1;
+}
+
+/*
+ * vring_free
+ *
+ * release a virtqueue and its indirect tables
+ *
+ */
+
+void vring_free(struct vring_virtqueue *vq)
+{
+    if (!vq)
+        return;
+    free(vq->indirect);
+    free(vq);
+}
+
 /*
  * vring_more_used
  *
@@ -34,6 +77,15 @@
 
 int vring_more_used(struct vring_virtqueue *vq)
 {
+    if (vq->use_packed) {
+        u16 flags = vq->packed.desc[vq->last_used_idx].flags;
+        int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+        int used = !!(flags & VRING_PACKED_DESC_F_USED);
+        /* Make sure ring reads are done after flags read above. */
+        smp_rmb();
+        return avail == used && used == vq->used_wrap;
+    }
+
     struct vring_used *used = vq->vring.used;
     int more = vq->last_used_idx != used->idx;
     /* Make sure ring reads are done after idx read above. */
@@ -56,6 +108,11 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
     /* find end of given descriptor */
 
     i = head;
+    if (desc[i].flags & VRING_DESC_F_INDIRECT) {
+        u32 table = ((u32)desc[i].addr - virt_to_phys(vq->indirect))
+            / (sizeof(struct vring_desc) * VRING_INDIRECT_MAX);
+        vq->indirect_free |= 1 << table;
+    }
     while (desc[i].flags & VRING_DESC_F_NEXT)
         i = desc[i].next;
 
@@ -65,6 +122,38 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
     vq->free_head = head;
 }
 
+/*
+ * vring_get_buf_packed
+ *
+ * get a buffer from a packed ring and release its buffer id
+ *
+ */
+
+static int vring_get_buf_packed(struct vring_virtqueue *vq, unsigned int *len)
+{
+    struct vring_packed *vr = &vq->packed;
+    struct vring_packed_desc *elem = &vr->desc[vq->last_used_idx];
+    u16 id = elem->id;
+    if (len != NULL)
+        *len = elem->len;
+
+    int ret = vq->vdata[id];
+
+    if (vq->packed_next[id] < VRING_INDIRECT_TABLES)
+        vq->indirect_free |= 1 << vq->packed_next[id];
+
+    vq->last_used_idx += vq->packed_descs[id];
+    if (vq->last_used_idx >= vr->num) {
+        vq->last_used_idx -= vr->num;
+        vq->used_wrap ^= 1;
+    }
+
+    vq->packed_next[id] = vq->free_head;
+    vq->free_head = id;
+
+    return ret;
+}
+
 /*
  * vring_get_buf
  *
@@ -74,6 +163,9 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
 
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 {
+    if (vq->use_packed)
+        return vring_get_buf_packed(vq, len);
+
     struct vring *vr = &vq->vring;
     struct vring_used_elem *elem;
     struct vring_used *used = vq->vring.used;
@@ -92,10 +184,151 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
     vring_detach(vq, id);
 
     vq->last_used_idx = vq->last_used_idx + 1;
+    if (vq->event_idx)
+        vring_used_event(vr) = vq->last_used_idx + 0x8000;
 
     return ret;
 }
 
+/*
+ * vring_fill_indirect
+ *
+ * place a buffer list in a free indirect table, return the table number
+ *
+ */
+
+static int vring_fill_indirect(struct vring_virtqueue *vq,
+                               struct vring_list list[],
+                               unsigned int out, unsigned int in)
+{
+    unsigned int i, num = out + in;
+
+    if (!vq->indirect_free || num < 2 || num > VRING_INDIRECT_MAX)
+        return -1;
+    u32 t = __ffs(vq->indirect_free);
+    vq->indirect_free &= ~(1 << t);
+    struct vring_desc *table = &vq->indirect[t * VRING_INDIRECT_MAX];
+
+    if (vq->use_packed) {
+        /* Packed layout: entries are consecutive, only WRITE is valid. */
+        struct vring_packed_desc *ptable = (void*)table;
+        for (i = 0; i < num; i++) {
+            ptable[i].addr = (u64)virt_to_phys(list[i].addr);
+            ptable[i].len = list[i].length;
+            ptable[i].id = 0;
+            ptable[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+        }
+        return t;
+    }
+
+    for (i = 0; i < num; i++) {
+        table[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+        if (i + 1 < num)
+            table[i].flags |= VRING_DESC_F_NEXT;
+        table[i].addr = (u64)virt_to_phys(list[i].addr);
+        table[i].len = list[i].length;
+        table[i].next = i + 1;
+    }
+    return t;
+}
+
+/*
+ * vring_add_indirect
+ *
+ * place a buffer list in an indirect table using a single ring slot
+ *
+ */
+
+static int vring_add_indirect(struct vring_virtqueue *vq,
+                              struct vring_list list[],
+                              unsigned int out, unsigned int in)
+{
+    struct vring_desc *desc = vq->vring.desc;
+    int t = vring_fill_indirect(vq, list, out, in);
+    if (t < 0)
+        return -1;
+
+    int head = vq->free_head;
+    desc[head].flags = VRING_DESC_F_INDIRECT;
+    desc[head].addr = (u64)virt_to_phys(&vq->indirect[t * VRING_INDIRECT_MAX]);
+    desc[head].len = sizeof(struct vring_desc) * (out + in);
+    vq->free_head = desc[head].next;
+    return head;
+}
+
+/*
+ * vring_add_buf_packed
+ *
+ * write a buffer list to the packed ring, publishing the head
+ * descriptor last so the device never sees a partial chain
+ *
+ */
+
+static void vring_add_buf_packed(struct vring_virtqueue *vq,
+                                 struct vring_list list[],
+                                 unsigned int out, unsigned int in,
+                                 int index)
+{
+    struct vring_packed *vr = &vq->packed;
+    struct vring_packed_desc *desc = vr->desc;
+    unsigned int i, n, num = out + in;
+    u16 id = vq->free_head, head = vq->next_avail, pos = head;
+    u8 wrap = vq->avail_wrap;
+    u16 flags, head_flags = 0;
+
+    vq->free_head = vq->packed_next[id];
+
+    int t = vring_fill_indirect(vq, list, out, in);
+    if (t >= 0) {
+        desc[pos].addr = (u64)virt_to_phys(&vq->indirect[t * VRING_INDIRECT_MAX]);
+        desc[pos].len = sizeof(struct vring_packed_desc) * num;
+        desc[pos].id = id;
+        head_flags = VRING_DESC_F_INDIRECT;
+        if (wrap)
+            head_flags |= VRING_PACKED_DESC_F_AVAIL;
+        else
+            head_flags |= VRING_PACKED_DESC_F_USED;
+        n = 1;
+        if (++pos >= vr->num) {
+            pos = 0;
+            wrap ^= 1;
+        }
+    } else {
+        for (i = 0; i < num; i++) {
+            desc[pos].addr = (u64)virt_to_phys(list[i].addr);
+            desc[pos].len = list[i].length;
+            desc[pos].id = id;
+            flags = i < out ? 0 : VRING_DESC_F_WRITE;
+            if (i + 1 < num)
+                flags |= VRING_DESC_F_NEXT;
+            if (wrap)
+                flags |= VRING_PACKED_DESC_F_AVAIL;
+            else
+                flags |= VRING_PACKED_DESC_F_USED;
+            if (i)
+                desc[pos].flags = flags;
+            else
+                head_flags = flags;
+            if (++pos >= vr->num) {
+                pos = 0;
+                wrap ^= 1;
+            }
+        }
+        n = num;
+    }
+
+    vq->packed_next[id] = t >= 0 ? t : VRING_INDIRECT_TABLES;
+    vq->packed_descs[id] = n;
+    vq->vdata[id] = index;
+    vq->next_avail = pos;
+    vq->avail_wrap = wrap;
+    vq->num_added += n;
+
+    /* Make sure the chain is written before the head is made available. */
+    smp_wmb();
+    desc[head].flags = head_flags;
+}
+
 void vring_add_buf(struct vring_virtqueue *vq,
                    struct vring_list list[],
                    unsigned int out, unsigned int in,
@@ -108,6 +341,15 @@ void vring_add_buf(struct vring_virtqueue *vq,
 
     BUG_ON(out + in == 0);
 
+    if (vq->use_packed) {
+        vring_add_buf_packed(vq, list, out, in, index);
+        return;
+    }
+
+    head = vring_add_indirect(vq, list, out, in);
+    if (head >= 0)
+        goto added;
+
     prev = 0;
     head = vq->free_head;
     for (i = head; out; i = desc[i].next, out--) {
@@ -128,20 +370,69 @@ void vring_add_buf(struct vring_virtqueue *vq,
 
     vq->free_head = i;
 
+added:
     vq->vdata[head] = index;
 
     av = (avail->idx + num_added) % vr->num;
     avail->ring[av] = head;
 }
 
+/*
+ * vring_kick_packed
+ *
+ * notify the device unless its event suppression area says otherwise
+ *
+ */
+
+static void vring_kick_packed(struct vp_device *vp,
+                              struct vring_virtqueue *vq)
+{
+    struct vring_packed *vr = &vq->packed;
+    u16 new = vq->next_avail, old = new - vq->num_added;
+    vq->num_added = 0;
+
+    /* Make sure the device sees the new descriptors before checking. */
+    smp_mb();
+    u16 off_wrap = vr->device->off_wrap;
+    u16 flags = vr->device->flags;
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+        return;
+    if (flags == VRING_PACKED_EVENT_FLAG_DESC) {
+        u16 event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+        if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->avail_wrap)
+            event -= vr->num;
+        if ((u16)(new - event - 1) >= (u16)(new - old))
+            return;
+    }
+
+    vp_notify(vp, vq);
+}
+
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 {
+    if (vq->use_packed) {
+        vring_kick_packed(vp, vq);
+        return;
+    }
+
     struct vring *vr = &vq->vring;
     struct vring_avail *avail = vr->avail;
+    u16 old = avail->idx, new = old + num_added;
 
     /* Make sure idx update is done after ring write. */
     smp_wmb();
-    avail->idx = avail->idx + num_added;
+    avail->idx = new;
+
+    /* Make sure the device sees the new idx before checking its state. */
+    smp_mb();
+    if (vq->event_idx) {
+        /* Only notify if the device asked to hear about these buffers. */
+        u16 event = vring_avail_event(vr);
+        if ((u16)(new - event - 1) >= (u16)(new - old))
+            return;
+    } else if (vr->used->flags & VRING_USED_F_NO_NOTIFY) {
+        return;
+    }
 
     vp_notify(vp, vq);
 }
@@ -19,16 +19,36 @@
 /* v1.0 compliant. */
 #define VIRTIO_F_VERSION_1              32
 #define VIRTIO_F_IOMMU_PLATFORM         33
+/* virtio 1.1 packed virtqueue layout */
+#define VIRTIO_F_RING_PACKED            34
+
+/* Ring features handled by the shared ring code. */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+#define VIRTIO_RING_F_EVENT_IDX         29
 
 #define MAX_QUEUE_NUM      (256)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+
+/* Indirect descriptor tables available per virtqueue */
+#define VRING_INDIRECT_TABLES 16
+/* Maximum number of descriptors in one indirect table */
+#define VRING_INDIRECT_MAX 16
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
 #define VRING_USED_F_NO_NOTIFY     1
 
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
 struct vring_desc
 {
    u64 addr;
@@ -64,19 +84,62 @@ struct vring {
    struct vring_used *used;
 };
 
+struct vring_packed_desc
+{
+   u64 addr;
+   u32 len;
+   u16 id;
+   u16 flags;
+};
+
+struct vring_packed_desc_event
+{
+   u16 off_wrap;
+   u16 flags;
+};
+
+struct vring_packed {
+   unsigned int num;
+   struct vring_packed_desc *desc;
+   struct vring_packed_desc_event *driver;
+   struct vring_packed_desc_event *device;
+};
+
 #define vring_size(num) \
     (ALIGN(sizeof(struct vring_desc) * num + sizeof(struct vring_avail) \
-           + sizeof(u16) * num, PAGE_SIZE)                              \
-     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num)
+           + sizeof(u16) * (num + 1), PAGE_SIZE)                        \
+     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num \
+     + sizeof(u16))
+
+/* Event index fields located after the avail and used rings */
+#define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
+#define vring_avail_event(vr) (*(u16 *)&(vr)->used->ring[(vr)->num])
 
 typedef unsigned char virtio_queue_t[vring_size(MAX_QUEUE_NUM)];
 
 struct vring_virtqueue {
    virtio_queue_t queue;
    struct vring vring;
+   /* free descriptor (split) or buffer id (packed) list */
    u16 free_head;
    u16 last_used_idx;
    u16 vdata[MAX_QUEUE_NUM];
+   /* VIRTIO_RING_F_INDIRECT_DESC */
+   struct vring_desc *indirect;
+   u32 indirect_free;
+   /* VIRTIO_RING_F_EVENT_IDX */
+   u8 event_idx;
+   /* VIRTIO_F_RING_PACKED */
+   u8 use_packed;
+   u8 avail_wrap;
+   u8 used_wrap;
+   u16 next_avail;
+   u16 num_added;
+   struct vring_packed packed;
+   /* next free id, or indirect table of an in-flight id */
+   u16 packed_next[MAX_QUEUE_NUM];
+   /* ring slots consumed by an in-flight id */
+   u8 packed_descs[MAX_QUEUE_NUM];
    /* PCI */
    int queue_index;
    int queue_notify_off;
@@ -109,7 +172,36 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
    vr->desc[i].next = 0;
 }
 
+static inline void
+vring_init_packed(struct vring_virtqueue *vq, unsigned int num)
+{
+   ASSERT32FLAT();
+   struct vring_packed *vr = &vq->packed;
+   vr->num = num;
+
+   /* descriptor ring must be 16 byte aligned, event areas 4 byte aligned */
+   vr->desc = (void*)ALIGN((u32)vq->queue, PAGE_SIZE);
+   vr->driver = (void*)&vr->desc[num];
+   vr->device = &vr->driver[1];
+
+   /* disable interrupts */
+   vr->driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+
+   vq->use_packed = 1;
+   vq->avail_wrap = vq->used_wrap = 1;
+   int i;
+   for (i = 0; i < num - 1; i++)
+       vq->packed_next[i] = i + 1;
+   vq->packed_next[i] = 0;
+}
+
+#define VRING_FEATURES ((1ull << VIRTIO_RING_F_INDIRECT_DESC) | \
+                        (1ull << VIRTIO_RING_F_EVENT_IDX) |     \
+                        (1ull << VIRTIO_F_RING_PACKED))
+
 struct vp_device;
+void vring_init_features(struct vring_virtqueue *vq, u64 features);
+void vring_free(struct vring_virtqueue *vq);
 int vring_more_used(struct vring_virtqueue *vq);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len);
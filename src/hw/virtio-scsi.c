@@ -184,9 +184,9 @@ init_virtio_scsi(void *data)
     }
     vp_init_simple(vp, pci);
     u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
+    u64 features = vp_get_features(vp);
 
     if (vp->use_modern) {
-        u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
         if (!(features & version1)) {
@@ -194,13 +194,17 @@ init_virtio_scsi(void *data)
             goto fail;
         }
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        features = features & (version1 | iommu_platform | VRING_FEATURES);
+        vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
             dprintf(1, "device didn't accept features: %pP\n", pci);
             goto fail;
         }
+    } else {
+        features = features & VRING_FEATURES;
+        vp_set_features(vp, features);
     }
 
     if (vp_find_vq(vp, 2, &vq) < 0 ) {
@@ -223,7 +227,7 @@ init_virtio_scsi(void *data)
 fail:
     vp_reset(vp);
     free(vp);
-    free(vq);
+    vring_free(vq);
 }
 
 /*
@@ -251,6 +255,17 @@ init_virtio_scsi_mmio(void *mmio)
     vp_init_mmio(vp, mmio);
     u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
 
+    u64 features = vp_get_features(vp);
+    u64 version1 = 1ull << VIRTIO_F_VERSION_1;
+    features = features & (version1 | VRING_FEATURES);
+    vp_set_features(vp, features);
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    vp_set_status(vp, status);
+    if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        dprintf(1, "device didn't accept features: %p\n", mmio);
+        goto fail;
+    }
+
     if (vp_find_vq(vp, 2, &vq) < 0 ) {
         dprintf(1, "fail to find vq for virtio-scsi-mmio %p\n", mmio);
         goto fail;
@@ -271,7 +286,7 @@ init_virtio_scsi_mmio(void *mmio)
 fail:
     vp_reset(vp);
     free(vp);
-    free(vq);
+    vring_free(vq);
 }
 
 void
@@ -298,6 +313,7 @@ virtio_scsi_setup(void)
             continue;
         }
 
-        run_thread(init_virtio_scsi, pci);
+        run_probe(znprintf(MAXPROBEDESC, "virtio-scsi %pP", pci)
+                  , init_virtio_scsi, pci);
     }
 }
@@ -14,6 +14,7 @@
 #include "stacks.h" // wait_preempt
 #include "std/optionrom.h" // OPTION_ROM_ALIGN
 #include "string.h" // memset
+#include "x86.h" // __fls
 
 // Information on a reserved area.
 struct allocinfo_s {
@@ -26,11 +27,14 @@ struct allocdetail_s {
     struct allocinfo_s detailinfo;
     struct allocinfo_s datainfo;
     u32 handle;
+    u8 detailzone, datazone; // indexes into Zones[]
 };
 
 // The various memory zones.
 struct zone_s {
     struct hlist_head head;
+    // Usage statistics (see malloc_report())
+    u32 used, peak, count, allocs, fails;
 };
 
 struct zone_s ZoneLow VARVERIFY32INIT, ZoneHigh VARVERIFY32INIT;
@@ -40,6 +44,19 @@ struct zone_s ZoneTmpLow VARVERIFY32INIT, ZoneTmpHigh VARVERIFY32INIT;
 static struct zone_s *Zones[] VARVERIFY32INIT = {
     &ZoneTmpLow, &ZoneLow, &ZoneFSeg, &ZoneTmpHigh, &ZoneHigh
 };
+static const char *ZoneNames[] VARVERIFY32INIT = {
+    "TmpLow", "Low", "FSeg", "TmpHigh", "High"
+};
+
+static int
+zone_index(struct zone_s *zone)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++)
+        if (Zones[i] == zone)
+            return i;
+    return 0;
+}
 
 
 /****************************************************************
@@ -63,6 +80,12 @@ alloc_new(struct zone_s *zone, u32 size, u32 align, struct allocinfo_s *fill)
 
             info->range_end = new_range_end;
             hlist_add_before(&fill->node, &info->node);
+
+            zone->used += size;
+            if (zone->used > zone->peak)
+                zone->peak = zone->used;
+            zone->count++;
+            zone->allocs++;
             return new_range_end;
         }
     }
@@ -73,9 +96,11 @@ alloc_new(struct zone_s *zone, u32 size, u32 align, struct allocinfo_s *fill)
 static struct allocdetail_s *
 alloc_new_detail(struct allocdetail_s *temp)
 {
+    temp->detailzone = zone_index(&ZoneTmpHigh);
     u32 detail_addr = alloc_new(&ZoneTmpHigh, sizeof(struct allocdetail_s)
                                 , MALLOC_MIN_ALIGN, &temp->detailinfo);
     if (!detail_addr) {
+        temp->detailzone = zone_index(&ZoneTmpLow);
         detail_addr = alloc_new(&ZoneTmpLow, sizeof(struct allocdetail_s)
                                 , MALLOC_MIN_ALIGN, &temp->detailinfo);
         if (!detail_addr) {
@@ -107,6 +132,7 @@ alloc_add(struct zone_s *zone, u32 start, u32 end)
     // Add space using temporary allocation info.
     struct allocdetail_s tempdetail;
     tempdetail.handle = MALLOC_DEFAULT_HANDLE;
+    tempdetail.datazone = zone_index(zone);
     tempdetail.datainfo.range_start = start;
     tempdetail.datainfo.range_end = end;
     tempdetail.datainfo.alloc_size = 0;
@@ -120,8 +146,10 @@ alloc_add(struct zone_s *zone, u32 start, u32 end)
 
 // Release space allocated with alloc_new()
 static void
-alloc_free(struct allocinfo_s *info)
+alloc_free(struct zone_s *zone, struct allocinfo_s *info)
 {
+    zone->used -= info->alloc_size;
+    zone->count--;
     struct allocinfo_s *next = container_of_or_null(
         info->node.next, struct allocinfo_s, node);
     if (next && next->range_end == info->range_start)
@@ -227,6 +255,190 @@ zonelow_expand(u32 size, u32 align, struct allocinfo_s *fill)
 }
 
 
+/****************************************************************
+ * slab caches for small allocations
+ ****************************************************************/
+
+// Small ZoneHigh/ZoneTmpHigh allocations are carved out of page sized
+// slabs, one cache per power of two size class, instead of each taking
+// a zone walk and a separate 'struct allocdetail_s'.
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_MIN_SHIFT 4 // 16 byte objects
+#define SLAB_CLASSES   5 // 16, 32, 64, 128, 256 byte objects
+#define SLAB_MAX_SIZE  (1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+#define SLAB_HASH_SIZE 64
+
+struct slab_cache_s {
+    struct zone_s *zone;
+    u32 size;
+    struct hlist_head partial, full;
+    u32 inuse, peak, allocs, pages;
+};
+
+// Header at the start of each slab page
+struct slab_s {
+    struct hlist_node node;
+    struct hlist_node hashnode;
+    struct slab_cache_s *cache;
+    void *freelist;
+    u32 inuse;
+};
+
+static struct slab_cache_s SlabCaches[2][SLAB_CLASSES];
+static struct hlist_head SlabHash[SLAB_HASH_SIZE];
+static int SlabReady;
+
+static struct hlist_head *
+slab_hash(u32 page)
+{
+    return &SlabHash[(page / SLAB_PAGE_SIZE) % SLAB_HASH_SIZE];
+}
+
+// Offset of the first object in a slab of the given cache
+static u32
+slab_first(struct slab_cache_s *cache)
+{
+    return ALIGN(sizeof(struct slab_s), cache->size);
+}
+
+// Find the cache serving an allocation, or NULL if it must use the zone.
+static struct slab_cache_s *
+slab_cache_find(struct zone_s *zone, u32 size, u32 align)
+{
+    if (!SlabReady || !size || size > SLAB_MAX_SIZE || align > MALLOC_MIN_ALIGN)
+        return NULL;
+    int z;
+    if (zone == &ZoneTmpHigh)
+        z = 0;
+    else if (zone == &ZoneHigh)
+        z = 1;
+    else
+        return NULL;
+    int cls = 0;
+    if (size > (1 << SLAB_MIN_SHIFT))
+        cls = __fls(size - 1) + 1 - SLAB_MIN_SHIFT;
+    return &SlabCaches[z][cls];
+}
+
+// Add a new slab page to a cache
+static struct slab_s *
+slab_grow(struct slab_cache_s *cache)
+{
+    u32 page = malloc_palloc(cache->zone, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+    if (!page)
+        return NULL;
+    struct slab_s *slab = memremap(page, SLAB_PAGE_SIZE);
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->freelist = NULL;
+    u32 pos;
+    for (pos = SLAB_PAGE_SIZE - cache->size; pos >= slab_first(cache)
+             ; pos -= cache->size) {
+        void **obj = (void*)slab + pos;
+        *obj = slab->freelist;
+        slab->freelist = obj;
+    }
+    hlist_add_head(&slab->node, &cache->partial);
+    hlist_add_head(&slab->hashnode, slab_hash(page));
+    cache->pages++;
+    return slab;
+}
+
+static void *
+slab_alloc(struct slab_cache_s *cache)
+{
+    struct slab_s *slab = container_of_or_null(
+        cache->partial.first, struct slab_s, node);
+    if (!slab) {
+        slab = slab_grow(cache);
+        if (!slab)
+            return NULL;
+    }
+    void **obj = slab->freelist;
+    slab->freelist = *obj;
+    slab->inuse++;
+    if (!slab->freelist) {
+        hlist_del(&slab->node);
+        hlist_add_head(&slab->node, &cache->full);
+    }
+    cache->allocs++;
+    if (++cache->inuse > cache->peak)
+        cache->peak = cache->inuse;
+    return obj;
+}
+
+// Return an object to its slab.  Returns -1 if 'data' isn't slab memory.
+static int
+slab_free(void *data)
+{
+    if (!SlabReady)
+        return -1;
+    u32 page = ALIGN_DOWN(virt_to_phys(data), SLAB_PAGE_SIZE);
+    struct slab_s *slab;
+    hlist_for_each_entry(slab, slab_hash(page), hashnode) {
+        if (virt_to_phys(slab) == page)
+            break;
+    }
+    if (!slab)
+        return -1;
+    struct slab_cache_s *cache = slab->cache;
+    u32 offset = data - (void*)slab;
+    if (offset < slab_first(cache) || offset % cache->size) {
+        warn_internalerror();
+        return 0;
+    }
+
+    if (!slab->freelist) {
+        hlist_del(&slab->node);
+        hlist_add_head(&slab->node, &cache->partial);
+    }
+    void **obj = data;
+    *obj = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->inuse--;
+
+    // Keep one empty slab around, give back any others.
+    if (!slab->inuse && (slab->node.next
+                         || slab->node.pprev != &cache->partial.first)) {
+        hlist_del(&slab->node);
+        hlist_del(&slab->hashnode);
+        cache->pages--;
+        malloc_pfree(page);
+    }
+    return 0;
+}
+
+static void
+slab_setup(void)
+{
+    static struct zone_s *zones[] = { &ZoneTmpHigh, &ZoneHigh };
+    int z, cls;
+    for (z=0; z<ARRAY_SIZE(zones); z++)
+        for (cls=0; cls<SLAB_CLASSES; cls++) {
+            SlabCaches[z][cls].zone = zones[z];
+            SlabCaches[z][cls].size = 1 << (SLAB_MIN_SHIFT + cls);
+        }
+    SlabReady = 1;
+}
+
+static void
+slab_report(void)
+{
+    int z, cls;
+    for (z=0; z<ARRAY_SIZE(SlabCaches); z++)
+        for (cls=0; cls<SLAB_CLASSES; cls++) {
+            struct slab_cache_s *cache = &SlabCaches[z][cls];
+            if (!cache->allocs)
+                continue;
+            dprintf(1, "slab %s-%d: %d in use (peak %d), %d allocs, %d pages\n"
+                    , cache->zone == &ZoneHigh ? "high" : "tmphigh"
+                    , cache->size, cache->inuse, cache->peak, cache->allocs
+                    , cache->pages);
+        }
+}
+
+
 /****************************************************************
  * tracked memory allocations
  ****************************************************************/
@@ -242,16 +454,20 @@ malloc_palloc(struct zone_s *zone, u32 size, u32 align)
     // Find and reserve space for main allocation
     struct allocdetail_s tempdetail;
     tempdetail.handle = MALLOC_DEFAULT_HANDLE;
+    tempdetail.datazone = zone_index(zone);
     u32 data = alloc_new(zone, size, align, &tempdetail.datainfo);
     if (!CONFIG_MALLOC_UPPERMEMORY && !data && zone == &ZoneLow)
         data = zonelow_expand(size, align, &tempdetail.datainfo);
-    if (!data)
+    if (!data) {
+        zone->fails++;
         return 0;
+    }
 
     // Find and reserve space for bookkeeping.
     struct allocdetail_s *detail = alloc_new_detail(&tempdetail);
     if (!detail) {
-        alloc_free(&tempdetail.datainfo);
+        alloc_free(zone, &tempdetail.datainfo);
+        zone->fails++;
         return 0;
     }
 
@@ -265,6 +481,12 @@ malloc_palloc(struct zone_s *zone, u32 size, u32 align)
 void * __malloc
 _malloc(struct zone_s *zone, u32 size, u32 align)
 {
+    struct slab_cache_s *cache = slab_cache_find(zone, size, align);
+    if (cache) {
+        void *data = slab_alloc(cache);
+        if (data)
+            return data;
+    }
     return memremap(malloc_palloc(zone, size, align), size);
 }
 
@@ -279,8 +501,8 @@ malloc_pfree(u32 data)
     struct allocdetail_s *detail = container_of(
         info, struct allocdetail_s, datainfo);
     dprintf(8, "phys_free %x (detail=%p)\n", data, detail);
-    alloc_free(info);
-    alloc_free(&detail->detailinfo);
+    alloc_free(Zones[detail->datazone], info);
+    alloc_free(Zones[detail->detailzone], &detail->detailinfo);
     return 0;
 }
 
@@ -289,6 +511,8 @@ free(void *data)
 {
     if (!data)
         return;
+    if (!slab_free(data))
+        return;
     int ret = malloc_pfree(virt_to_phys(data));
     if (ret)
         warn_internalerror();
@@ -350,6 +574,32 @@ malloc_findhandle(u32 handle)
 }
 
 
+// Print usage and fragmentation statistics for all zones.
+static void
+malloc_report(void)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++) {
+        struct zone_s *zone = Zones[i];
+        u32 largest = 0, gaps = 0, space = 0;
+        struct allocinfo_s *info;
+        hlist_for_each_entry(info, &zone->head, node) {
+            u32 avail = info->range_end - info->range_start - info->alloc_size;
+            if (!avail)
+                continue;
+            gaps++;
+            space += avail;
+            if (avail > largest)
+                largest = avail;
+        }
+        dprintf(1, "zone %s: used %d (peak %d) in %d blocks, %d allocs"
+                ", %d failed; free %d in %d gaps, largest %d\n"
+                , ZoneNames[i], zone->used, zone->peak, zone->count
+                , zone->allocs, zone->fails, space, gaps, largest);
+    }
+}
+
+
 /****************************************************************
  * 0xc0000-0xf0000 management
  ****************************************************************/
@@ -533,6 +783,7 @@ malloc_init(void)
            , SYMBOL(zonefseg_end) - SYMBOL(zonefseg_start));
     alloc_add(&ZoneFSeg, SYMBOL(zonefseg_start), SYMBOL(zonefseg_end));
 
+    slab_setup();
     calcRamSize();
 }
 
@@ -541,6 +792,8 @@ malloc_prepboot(void)
 {
     ASSERT32FLAT();
     dprintf(3, "malloc finalize\n");
+    malloc_report();
+    slab_report();
 
     u32 base = rom_get_max();
     memset((void*)RomEnd, 0, base-RomEnd);
@@ -173,16 +173,37 @@ getRomPriority(u64 *sources, struct rom_header *rom, int instance)
 static struct rom_header *
 deploy_romfile(struct romfile_s *file)
 {
+    // Check the header before reserving space and copying the rom, but
+    // only where the backend can read part of a file - otherwise (eg,
+    // compressed files) the check would decompress the rom twice.
+    struct rom_header hdr;
+    if (file->read) {
+        int ret = romfile_read(file, &hdr, 0, sizeof(hdr));
+        if (ret != sizeof(hdr) || hdr.signature != OPTION_ROM_SIGNATURE)
+            goto notrom;
+    }
+
     u32 size = file->size;
     struct rom_header *rom = rom_reserve(size);
     if (!rom) {
         warn_noalloc();
         return NULL;
     }
-    int ret = file->copy(file, rom, size);
+    int ret;
+    if (file->read)
+        ret = romfile_read(file, rom, 0, size);
+    else
+        // Decode straight into the reserved area.
+        ret = file->copy(file, rom, size);
     if (ret <= 0)
         return NULL;
+    if (ret < sizeof(hdr) || rom->signature != OPTION_ROM_SIGNATURE)
+        goto notrom;
     return rom;
+
+notrom:
+    dprintf(1, "Skipping romfile '%s' - not an option rom\n", file->name);
+    return NULL;
 }
 
 // Run all roms in a given CBFS directory.
@@ -181,6 +181,12 @@ device_hardware_setup(void)
     olly_printf("5------device_hardware_setup\n");
     cbfs_payload_setup();
     olly_printf("6------device_hardware_setup\n");
+
+    // Probes may keep running during option rom execution; otherwise
+    // they are waited for right after this anyway.
+    if (!threads_during_optionroms())
+        wait_threads();
+    probe_report();
 }
 
 /*
@@ -241,6 +247,8 @@ prepareboot(void)
     // Finalize data structures before boot
     cdrom_prepboot();
     pmm_prepboot();
+    smp_prepboot();
+    thread_prepboot();
     malloc_prepboot();
     e820_prepboot();
 
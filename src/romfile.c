@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "config.h" // CONFIG_*
+#include "fw/lz4decode.h" // lz4_decode
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "romfile.h" // struct romfile_s
@@ -12,43 +13,217 @@
 
 /*
  * 所有的romfile对象
+ * RomfileHash按文件名哈希, RomfileSorted按文件名排序(用于前缀查找)
  */
-static struct romfile_s *RomfileRoot VARVERIFY32INIT;
+#define ROMFILE_HASH_SIZE 64
+#define ROMFILE_SORTED_MIN 64
 
-//添加一个romfile_s对象到RomfileRoot 链表
+static struct romfile_s *RomfileHash[ROMFILE_HASH_SIZE] VARVERIFY32INIT;
+static struct romfile_s **RomfileSorted VARVERIFY32INIT;
+static int RomfileCount VARVERIFY32INIT, RomfileSortedCount VARVERIFY32INIT;
+static int RomfileSortedMax VARVERIFY32INIT;
+
+static u32
+romfile_hash(const char *name)
+{
+    u32 hash = 2166136261;
+    while (*name)
+        hash = (hash ^ (u8)*name++) * 16777619;
+    return hash % ROMFILE_HASH_SIZE;
+}
+
+// Add a file to the (not yet sorted) tail of the prefix index.
+static void
+romfile_index_add(struct romfile_s *file)
+{
+    if (RomfileCount >= RomfileSortedMax) {
+        int max = RomfileSortedMax ? RomfileSortedMax * 2 : ROMFILE_SORTED_MIN;
+        struct romfile_s **sorted = malloc_tmp(max * sizeof(sorted[0]));
+        if (!sorted) {
+            warn_noalloc();
+            return;
+        }
+        memcpy(sorted, RomfileSorted, RomfileCount * sizeof(sorted[0]));
+        free(RomfileSorted);
+        RomfileSorted = sorted;
+        RomfileSortedMax = max;
+    }
+    RomfileSorted[RomfileCount++] = file;
+}
+
+// Insert any newly added files into the sorted part of the index.
+// Files usually arrive in name order, so this is close to linear.
+static void
+romfile_index_sort(void)
+{
+    if (RomfileSortedCount == RomfileCount)
+        return;
+    int i, j;
+    for (i = RomfileSortedCount; i < RomfileCount; i++) {
+        struct romfile_s *file = RomfileSorted[i];
+        // A later file with the same name sorts first, so it shadows the
+        // earlier one as it does for romfile_find().
+        for (j = i; j > 0 && strcmp(RomfileSorted[j-1]->name, file->name) >= 0
+                 ; j--)
+            RomfileSorted[j] = RomfileSorted[j-1];
+        RomfileSorted[j] = file;
+    }
+    for (i = 0; i < RomfileCount; i++)
+        RomfileSorted[i]->sortidx = i;
+    RomfileSortedCount = RomfileCount;
+}
+
+//添加一个romfile_s对象到RomfileHash和RomfileSorted
 void
 romfile_add(struct romfile_s *file)
 {
     dprintf(3, "Add romfile: %s (size=%d)\n", file->name, file->size);
-    file->next = RomfileRoot;
-    RomfileRoot = file;
+    struct romfile_s **head = &RomfileHash[romfile_hash(file->name)];
+    file->next = *head;
+    *head = file;
+    romfile_index_add(file);
+}
+
+// Search for the next file (in name order) starting with 'prefix'.
+struct romfile_s *
+romfile_findprefix(const char *prefix, struct romfile_s *prev)
+{
+    romfile_index_sort();
+    int prefixlen = strlen(prefix), idx;
+    if (prev) {
+        idx = prev->sortidx + 1;
+    } else {
+        // Binary search for the first name not below 'prefix'.
+        int hi = RomfileCount;
+        idx = 0;
+        while (idx < hi) {
+            int mid = (idx + hi) / 2;
+            if (strcmp(RomfileSorted[mid]->name, prefix) < 0)
+                idx = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+    if (idx >= RomfileCount
+        || memcmp(prefix, RomfileSorted[idx]->name, prefixlen) != 0)
+        return NULL;
+    return RomfileSorted[idx];
 }
 
-// Search for the specified file.
-static struct romfile_s *
-__romfile_findprefix(const char *prefix, int prefixlen, struct romfile_s *prev)
+struct romfile_s *
+romfile_find(const char *name)
 {
-    struct romfile_s *cur = RomfileRoot;
-    if (prev)
-        cur = prev->next;
+    struct romfile_s *cur = RomfileHash[romfile_hash(name)];
     while (cur) {
-        if (memcmp(prefix, cur->name, prefixlen) == 0)
+        if (strcmp(name, cur->name) == 0)
             return cur;
         cur = cur->next;
     }
     return NULL;
 }
 
-struct romfile_s *
-romfile_findprefix(const char *prefix, struct romfile_s *prev)
+
+/****************************************************************
+ * Content cache
+ ****************************************************************/
+
+/*
+ * 最近读取过的文件内容(LRU), 重复读取同一个文件时直接从内存复制.
+ * 主要用于没有read()方法的文件(如lzma压缩的CBFS文件), 避免每次
+ * 部分读取都重新解压整个文件
+ */
+#define ROMFILE_CACHE_ENTRIES 4
+#define ROMFILE_CACHE_MAXSIZE (64*1024)
+
+struct romfile_cache_s {
+    struct romfile_s *file;
+    void *data;
+    u32 lastuse;
+};
+static struct romfile_cache_s RomfileCache[ROMFILE_CACHE_ENTRIES] VARVERIFY32INIT;
+static u32 RomfileCacheClock VARVERIFY32INIT;
+
+static struct romfile_cache_s *
+romfile_cache_find(struct romfile_s *file)
 {
-    return __romfile_findprefix(prefix, strlen(prefix), prev);
+    int i;
+    for (i=0; i<ARRAY_SIZE(RomfileCache); i++) {
+        struct romfile_cache_s *entry = &RomfileCache[i];
+        if (entry->file == file) {
+            entry->lastuse = ++RomfileCacheClock;
+            return entry;
+        }
+    }
+    return NULL;
 }
 
-struct romfile_s *
-romfile_find(const char *name)
+// Keep a copy of a file's contents, replacing the least recently
+// used entry.  The cache is best effort - failures are ignored.
+static void
+romfile_cache_add(struct romfile_s *file, void *data)
+{
+    if (file->size > ROMFILE_CACHE_MAXSIZE || romfile_cache_find(file))
+        return;
+    struct romfile_cache_s *victim = &RomfileCache[0];
+    int i;
+    for (i=1; i<ARRAY_SIZE(RomfileCache) && victim->file; i++)
+        if (!RomfileCache[i].file
+            || RomfileCache[i].lastuse < victim->lastuse)
+            victim = &RomfileCache[i];
+    void *copy = malloc_tmphigh(file->size);
+    if (!copy)
+        return;
+    memcpy(copy, data, file->size);
+    free(victim->data);
+    victim->file = file;
+    victim->data = copy;
+    victim->lastuse = ++RomfileCacheClock;
+}
+
+// Forget any cached state of a file whose contents have changed.
+void
+romfile_invalidate(struct romfile_s *file)
+{
+    file->intstate = ROMFILE_INT_UNKNOWN;
+    struct romfile_cache_s *entry = romfile_cache_find(file);
+    if (!entry)
+        return;
+    free(entry->data);
+    memset(entry, 0, sizeof(*entry));
+}
+
+// Read part of a file - returns the number of bytes read (which is
+// less than 'len' at the end of the file) or -1 on error.
+int
+romfile_read(struct romfile_s *file, void *dst, u32 offset, u32 len)
 {
-    return __romfile_findprefix(name, strlen(name) + 1, NULL);
+    if (offset >= file->size)
+        return 0;
+    if (len > file->size - offset)
+        len = file->size - offset;
+
+    struct romfile_cache_s *entry = romfile_cache_find(file);
+    if (entry) {
+        memcpy(dst, entry->data + offset, len);
+        return len;
+    }
+    if (file->read)
+        return file->read(file, dst, offset, len);
+
+    // No partial read support - load the whole file and cache it.
+    void *data = malloc_tmphigh(file->size);
+    if (!data) {
+        warn_noalloc();
+        return -1;
+    }
+    int ret = file->copy(file, data, file->size);
+    if (ret >= 0) {
+        memcpy(dst, data + offset, len);
+        romfile_cache_add(file, data);
+        ret = len;
+    }
+    free(data);
+    return ret;
 }
 
 // Helper function to find, malloc_tmphigh, and copy a romfile.  This
@@ -70,12 +245,18 @@ romfile_loadfile(const char *name, int *psize)
         return NULL;
     }
 
-    dprintf(5, "Copying romfile '%s' (len %d)\n", name, filesize);
-    //将数据复制到data地址
-    int ret = file->copy(file, data, filesize);
-    if (ret < 0) {
-        free(data);
-        return NULL;
+    struct romfile_cache_s *entry = romfile_cache_find(file);
+    if (entry) {
+        memcpy(data, entry->data, filesize);
+    } else {
+        dprintf(5, "Copying romfile '%s' (len %d)\n", name, filesize);
+        //将数据复制到data地址
+        int ret = file->copy(file, data, filesize);
+        if (ret < 0) {
+            free(data);
+            return NULL;
+        }
+        romfile_cache_add(file, data);
     }
     if (psize)
         *psize = filesize;
@@ -92,16 +273,27 @@ romfile_loadint(const char *name, u64 defval)
     if (!file)
         return defval;
 
-    int filesize = file->size;
-    if (!filesize || filesize > sizeof(u64) || (filesize & (filesize-1)))
-        // Doesn't look like a valid integer.
-        return defval;
+    /*
+     * 整数值只在第一次读取时解析(fw_cfg读取会导致vmexit),
+     * 之后直接返回缓存在romfile_s中的值
+     */
+    if (file->intstate == ROMFILE_INT_UNKNOWN) {
+        file->intstate = ROMFILE_INT_INVALID;
+        int filesize = file->size;
+        if (!filesize || filesize > sizeof(u64) || (filesize & (filesize-1)))
+            // Doesn't look like a valid integer.
+            return defval;
 
-    u64 val = 0;
-    int ret = file->copy(file, &val, sizeof(val));
-    if (ret < 0)
+        u64 val = 0;
+        int ret = file->copy(file, &val, sizeof(val));
+        if (ret < 0)
+            return defval;
+        file->intval = val;
+        file->intstate = ROMFILE_INT_VALID;
+    }
+    if (file->intstate != ROMFILE_INT_VALID)
         return defval;
-    return val;
+    return file->intval;
 }
 
 struct const_romfile_s {
@@ -122,6 +314,15 @@ const_read_file(struct romfile_s *file, void *dst, u32 maxlen)
     return file->size;
 }
 
+static int
+const_read_part(struct romfile_s *file, void *dst, u32 offset, u32 len)
+{
+    struct const_romfile_s *cfile;
+    cfile = container_of(file, struct const_romfile_s, file);
+    memcpy(dst, cfile->data + offset, len);
+    return len;
+}
+
 static void
 const_romfile_add(char *name, void *data, int size)
 {
@@ -134,10 +335,76 @@ const_romfile_add(char *name, void *data, int size)
     strtcpy(cfile->file.name, name, sizeof(cfile->file.name));
     cfile->file.size = size;
     cfile->file.copy = const_read_file;
+    cfile->file.read = const_read_part;
     cfile->data = data;
     romfile_add(&cfile->file);
 }
 
+
+/****************************************************************
+ * Compressed romfiles
+ ****************************************************************/
+
+struct lz4_romfile_s {
+    struct romfile_s file;
+    struct romfile_s *raw;
+};
+
+static int
+lz4_read_file(struct romfile_s *file, void *dst, u32 maxlen)
+{
+    if (file->size > maxlen)
+        return -1;
+    struct lz4_romfile_s *zfile;
+    zfile = container_of(file, struct lz4_romfile_s, file);
+    struct romfile_s *raw = zfile->raw;
+    void *temp = malloc_tmphigh(raw->size);
+    if (!temp) {
+        warn_noalloc();
+        return -1;
+    }
+    int ret = raw->copy(raw, temp, raw->size);
+    if (ret >= 0)
+        ret = lz4_decode(dst, maxlen, temp, raw->size);
+    free(temp);
+    return ret;
+}
+
+/*
+ * qemu_cfg_init()
+ *  romfile_add_lz4()
+ *
+ * 为一个lz4压缩的文件(如"foo.lz4")添加一个解压后的文件("foo").
+ * 解压后的大小必须记录在lz4 frame头中
+ */
+void
+romfile_add_lz4(struct romfile_s *raw)
+{
+    if (!CONFIG_LZ4)
+        return;
+    int len = strlen(raw->name);
+    if (len <= 4 || strcmp(&raw->name[len-4], ".lz4") != 0)
+        return;
+    u8 hdr[LZ4_MAX_HEADER_SIZE];
+    int ret = romfile_read(raw, hdr, 0, sizeof(hdr));
+    int size = ret > 0 ? lz4_content_size(hdr, ret) : -1;
+    if (size < 0) {
+        dprintf(1, "romfile '%s' has no lz4 content size\n", raw->name);
+        return;
+    }
+    struct lz4_romfile_s *zfile = malloc_tmp(sizeof(*zfile));
+    if (!zfile) {
+        warn_noalloc();
+        return;
+    }
+    memset(zfile, 0, sizeof(*zfile));
+    strtcpy(zfile->file.name, raw->name, len - 4 + 1);
+    zfile->file.size = size;
+    zfile->file.copy = lz4_read_file;
+    zfile->raw = raw;
+    romfile_add(&zfile->file);
+}
+
 void
 const_romfile_add_int(char *name, u32 value)
 {
@@ -5,22 +5,39 @@
 
 // romfile.c
 struct romfile_s {
-    struct romfile_s *next;
+    struct romfile_s *next; // next file in the same hash bucket
     char name[128];
     u32 size;
+    u32 sortidx; // position in the sorted prefix index
+    u8 intstate; // ROMFILE_INT_* - cached result of romfile_loadint()
+    u64 intval;
     /*
      * cbfs_copyfile,
      * const_read_file
      * qemu_cfg_read_file,
      */
     int (*copy)(struct romfile_s *file, void *dest, u32 maxlen);
+    /*
+     * 可选 - 从offset处读取len字节
+     * cbfs_readfile,
+     * const_read_part,
+     * mbfs_readfile,
+     * qemu_cfg_read_part,
+     */
+    int (*read)(struct romfile_s *file, void *dest, u32 offset, u32 len);
 };
+#define ROMFILE_INT_UNKNOWN 0
+#define ROMFILE_INT_VALID   1
+#define ROMFILE_INT_INVALID 2
 void romfile_add(struct romfile_s *file);
 struct romfile_s *romfile_findprefix(const char *prefix, struct romfile_s *prev);
 struct romfile_s *romfile_find(const char *name);
+int romfile_read(struct romfile_s *file, void *dst, u32 offset, u32 len);
+void romfile_invalidate(struct romfile_s *file);
 void *romfile_loadfile(const char *name, int *psize);
 u64 romfile_loadint(const char *name, u64 defval);
 
+void romfile_add_lz4(struct romfile_s *raw);
 void const_romfile_add_int(char *name, u32 value);
 
 #endif // romfile.h
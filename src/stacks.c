@@ -472,11 +472,30 @@ reset(void)
 struct thread_info {
     void *stackpos;
     struct hlist_node node;
+    // Set while the thread is parked in yield_wait()
+    int (*waitcond)(void *data);
+    void *waitdata;
+    u32 waketime;
+    u8 waiting;
+    // Run time accounting (see thread_profile_report())
+    struct thread_prof_s *prof;
+    u32 lastswitch;
 };
+
+// Per-thread profile record - outlives the thread's stack
+struct thread_prof_s {
+    struct hlist_node node;
+    const char *desc;
+    void (*func)(void*);
+    void *caller;
+    u32 created, ended, runtime, yields;
+};
+#define THREAD_PROFILE (CONFIG_DEBUG_LEVEL >= DEBUG_thread_profile)
 struct thread_info MainThread VARFSEG = {
     NULL, { &MainThread.node, &MainThread.node.next }
 };
 #define THREADSTACKSIZE 4096
+#define THREADPOOL_DEFAULT 16
 
 // Check if any threads are running.
 static int
@@ -496,7 +515,14 @@ getCurThread(void)
     return (void*)ALIGN_DOWN(esp, THREADSTACKSIZE);
 }
 
-static u8 CanInterrupt, ThreadControl;
+static u8 CanInterrupt, ThreadControl, ProbeLimit;
+
+// Pool of pre-carved thread stacks
+static struct hlist_head ThreadPoolFree;
+static void *ThreadPool;
+static int ThreadPoolSize, ThreadPoolStrict;
+static int ThreadCount, ThreadPeak;
+static struct hlist_head ThreadProfiles;
 
 
 /*
@@ -516,6 +542,125 @@ thread_setup(void)
     if (! CONFIG_THREADS)
         return;
     ThreadControl = romfile_loadint("etc/threads", 1);
+    ProbeLimit = romfile_loadint("etc/probe-threads", 0);
+    if (!ThreadControl)
+        return;
+
+    // An explicit "etc/thread-stacks" is a hard limit on the number of
+    // threads; without it a default sized pool is used and further
+    // stacks are allocated on demand.
+    ThreadPoolSize = romfile_loadint("etc/thread-stacks", 0);
+    ThreadPoolStrict = ThreadPoolSize > 0;
+    if (!ThreadPoolStrict)
+        ThreadPoolSize = THREADPOOL_DEFAULT;
+    ThreadPool = memalign_tmphigh(THREADSTACKSIZE
+                                  , ThreadPoolSize * THREADSTACKSIZE);
+    if (!ThreadPool) {
+        warn_noalloc();
+        ThreadPoolSize = 0;
+        return;
+    }
+    int i;
+    for (i = ThreadPoolSize - 1; i >= 0; i--) {
+        struct thread_info *thread = ThreadPool + i * THREADSTACKSIZE;
+        hlist_add_head(&thread->node, &ThreadPoolFree);
+    }
+}
+
+// Take a stack from the pool, or allocate one if the pool may grow.
+static struct thread_info *
+thread_stack_alloc(void)
+{
+    struct thread_info *thread;
+    if (!hlist_empty(&ThreadPoolFree)) {
+        thread = container_of(ThreadPoolFree.first, struct thread_info, node);
+        hlist_del(&thread->node);
+    } else {
+        if (ThreadPoolStrict)
+            return NULL;
+        thread = memalign_tmphigh(THREADSTACKSIZE, THREADSTACKSIZE);
+        if (!thread)
+            return NULL;
+    }
+    if (++ThreadCount > ThreadPeak)
+        ThreadPeak = ThreadCount;
+    return thread;
+}
+
+// Return a thread stack to the pool (or to the allocator).
+static void
+thread_stack_free(struct thread_info *thread)
+{
+    ThreadCount--;
+    if ((void*)thread >= ThreadPool
+        && (void*)thread < ThreadPool + ThreadPoolSize * THREADSTACKSIZE) {
+        hlist_add_head(&thread->node, &ThreadPoolFree);
+        return;
+    }
+    free(thread);
+}
+
+/*
+ * handle_post()
+ *  dopost()
+ *   reloc_preinit(f==maininit)
+ *    maininit()
+ *     prepareboot()
+ *      thread_prepboot()
+ */
+// Print the threads sorted by the time they spent running.
+static void
+thread_profile_report(void)
+{
+    struct hlist_head sorted = { NULL };
+    struct thread_prof_s *prof, *pos;
+    struct hlist_node *n, **pprev;
+    hlist_for_each_entry_safe(prof, n, &ThreadProfiles, node) {
+        hlist_del(&prof->node);
+        pprev = &sorted.first;
+        hlist_for_each_entry(pos, &sorted, node) {
+            if (pos->runtime < prof->runtime)
+                break;
+            pprev = &pos->node.next;
+        }
+        hlist_add(&prof->node, pprev);
+    }
+    if (hlist_empty(&sorted))
+        return;
+
+    dprintf(DEBUG_thread_profile, "Thread profile (us):\n");
+    hlist_for_each_entry_safe(prof, n, &sorted, node) {
+        u32 runtime = timer_ticks_to_us(prof->runtime);
+        const char *desc = prof->desc ?: "thread";
+        if (prof->ended)
+            dprintf(DEBUG_thread_profile, "  %s func %p from %p: run %u, wait %u, yields %u\n"
+                    , desc, prof->func, prof->caller, runtime
+                    , timer_ticks_to_us(prof->ended - prof->created) - runtime
+                    , prof->yields);
+        else
+            dprintf(DEBUG_thread_profile, "  %s func %p from %p: run %u, yields %u, not finished\n"
+                    , desc, prof->func, prof->caller, runtime, prof->yields);
+        hlist_del(&prof->node);
+        free(prof);
+    }
+}
+
+// Release the stack pool before the temporary memory zones go away.
+void
+thread_prepboot(void)
+{
+    if (!CONFIG_THREADS)
+        return;
+    probe_report();
+    if (THREAD_PROFILE)
+        thread_profile_report();
+    dprintf(1, "Threads: peak %d concurrent, pool of %d stacks%s\n"
+            , ThreadPeak, ThreadPoolSize
+            , ThreadPoolStrict ? " (limit)" : "");
+    free(ThreadPool);
+    ThreadPool = NULL;
+    ThreadPoolSize = 0;
+    ThreadPoolFree.first = NULL;
 }
 
 // Should hardware initialization threads run during optionrom execution.
@@ -525,15 +670,59 @@ threads_during_optionroms(void)
     return CONFIG_THREADS && CONFIG_RTC_TIMER && ThreadControl == 2 && in_post();
 }
 
+// Check if a thread parked in yield_wait() has something to do.
+static int
+thread_runnable(struct thread_info *thread, u32 *now, int *havenow)
+{
+    if (!thread->waiting)
+        return 1;
+    if (!*havenow) {
+        *now = timer_read();
+        *havenow = 1;
+    }
+    if ((s32)(*now - thread->waketime) > 0)
+        return 1;
+    return thread->waitcond && thread->waitcond(thread->waitdata);
+}
+
+// Find the next thread after 'cur' that can make progress.  The main
+// thread is never parked, so the search always ends.
+static struct thread_info *
+thread_next(struct thread_info *cur)
+{
+    u32 now = 0;
+    int havenow = 0;
+    struct thread_info *next = cur;
+    for (;;) {
+        next = container_of(next->node.next, struct thread_info, node);
+        if (next == cur || thread_runnable(next, &now, &havenow))
+            return next;
+    }
+}
+
+// Charge the time since 'cur' was switched in to its profile.
+static void
+thread_account(struct thread_info *cur, struct thread_info *next)
+{
+    if (!THREAD_PROFILE)
+        return;
+    u32 now = timer_read();
+    if (cur->prof)
+        cur->prof->runtime += now - cur->lastswitch;
+    next->lastswitch = now;
+}
+
 // Switch to next thread stack.
 static void
 switch_next(struct thread_info *cur)
 {
-    struct thread_info *next = container_of(
-        cur->node.next, struct thread_info, node);
+    struct thread_info *next = thread_next(cur);
+    if (THREAD_PROFILE && cur->prof)
+        cur->prof->yields++;
     if (cur == next)
         // Nothing to do.
         return;
+    thread_account(cur, next);
     asm volatile(
         "  pushl $1f\n"                 // store return pc
         "  pushl %%ebp\n"               // backup %ebp
@@ -551,31 +740,57 @@ switch_next(struct thread_info *cur)
 static void
 __end_thread(struct thread_info *old)
 {
+    if (THREAD_PROFILE) {
+        struct thread_info *next = container_of(
+            old->node.next, struct thread_info, node);
+        thread_account(old, next);
+        if (old->prof)
+            old->prof->ended = next->lastswitch;
+    }
     hlist_del(&old->node);
     dprintf(DEBUG_thread, "\\%08x/ End thread\n", (u32)old);
-    free(old);
+    thread_stack_free(old);
     if (!have_threads())
         dprintf(1, "All threads complete.\n");
 }
 
 void VISIBLE16 check_irqs(void);
 
-// Create a new thread and start executing 'func' in it.
-void
-run_thread(void (*func)(void*), void *data)
+// Create a new thread and start executing 'func' in it.  The thread is
+// profiled as 'desc'/'pfunc' created from 'caller', which lets wrappers
+// such as run_probe() charge it to the code they were called for.
+static void
+__run_thread(void (*func)(void*), void *data, const char *desc
+             , void (*pfunc)(void*), void *caller)
 {
     ASSERT32FLAT();
     if (! CONFIG_THREADS || ! ThreadControl)
         goto fail;
     struct thread_info *thread;
-    thread = memalign_tmphigh(THREADSTACKSIZE, THREADSTACKSIZE);
+    thread = thread_stack_alloc();
     if (!thread)
         goto fail;
 
     dprintf(DEBUG_thread, "/%08x\\ Start thread\n", (u32)thread);
     thread->stackpos = (void*)thread + THREADSTACKSIZE;
+    thread->waiting = 0;
+    thread->prof = NULL;
     struct thread_info *cur = getCurThread();
     struct thread_info *edx = cur;
+    if (THREAD_PROFILE) {
+        struct thread_prof_s *prof = malloc_tmp(sizeof(*prof));
+        if (prof) {
+            memset(prof, 0, sizeof(*prof));
+            prof->desc = desc;
+            prof->func = pfunc;
+            prof->caller = caller;
+            hlist_add_head(&prof->node, &ThreadProfiles);
+            thread->prof = prof;
+        }
+        thread_account(cur, thread);
+        if (prof)
+            prof->created = thread->lastswitch;
+    }
     hlist_add_after(&thread->node, &cur->node);
     asm volatile(
         // Start thread
@@ -606,6 +821,14 @@ fail:
     func(data);
 }
 
+// Create a new thread and start executing 'func' in it.  Not inlined,
+// so that the profile records the real caller.
+void noinline
+run_thread(void (*func)(void*), void *data)
+{
+    __run_thread(func, data, NULL, func, __builtin_return_address(0));
+}
+
 
 /****************************************************************
  * Thread helpers
@@ -668,6 +891,37 @@ yield_toirq(void)
     wait_irq();
 }
 
+// Wait until 'cond(data)' returns true or the timer passes 'end'.  A
+// thread other than the main thread is parked meanwhile: the scheduler
+// skips it without a stack switch until its deadline passes or its
+// condition (evaluated by the scheduler, so it must not yield) holds.
+// Returns 0 if the condition was met and -1 on timeout.
+int
+yield_wait(int (*cond)(void *data), void *data, u32 end)
+{
+    for (;;) {
+        if (cond && cond(data))
+            return 0;
+        if (timer_check(end))
+            return -1;
+        if (MODESEGMENT || !CONFIG_THREADS) {
+            check_irqs();
+            continue;
+        }
+        struct thread_info *cur = getCurThread();
+        if (cur == &MainThread) {
+            yield();
+            continue;
+        }
+        cur->waitcond = cond;
+        cur->waitdata = data;
+        cur->waketime = end;
+        cur->waiting = 1;
+        switch_next(cur);
+        cur->waiting = 0;
+    }
+}
+
 // Wait for all threads (other than the main thread) to complete.
 void
 wait_threads(void)
@@ -698,6 +952,110 @@ mutex_unlock(struct mutex_s *mutex)
 }
 
 
+/****************************************************************
+ * Device probe scheduling
+ ****************************************************************/
+
+struct probe_s {
+    struct hlist_node node;
+    const char *desc;
+    void (*func)(void*);
+    void *data;
+    u32 queued, start, end;
+};
+
+static struct hlist_head ProbeList;
+static struct hlist_node **ProbeLast = &ProbeList.first;
+static int ProbeActive, ProbeCount;
+// Queue time of the first probe - all report times are relative to it
+static u32 ProbeBase;
+
+static void
+probe_thread(void *data)
+{
+    struct probe_s *probe = data;
+    probe->start = timer_read();
+    probe->func(probe->data);
+    probe->end = timer_read();
+    ProbeActive--;
+}
+
+// Start a controller probe in its own thread and record its timing.  At
+// most "etc/probe-threads" probes started from the main thread run at
+// once (0 means no limit); probes started from within a probe are not
+// held back, as their parent already occupies a slot.
+void noinline
+run_probe(const char *desc, void (*func)(void*), void *data)
+{
+    ASSERT32FLAT();
+    struct probe_s *probe = malloc_tmp(sizeof(*probe));
+    if (!probe) {
+        warn_noalloc();
+        __run_thread(func, data, desc, func, __builtin_return_address(0));
+        return;
+    }
+    memset(probe, 0, sizeof(*probe));
+    probe->desc = desc;
+    probe->func = func;
+    probe->data = data;
+    probe->queued = timer_read();
+    if (!ProbeCount++)
+        ProbeBase = probe->queued;
+    hlist_add(&probe->node, ProbeLast);
+    ProbeLast = &probe->node.next;
+
+    if (ProbeLimit && getCurThread() == &MainThread)
+        while (ProbeActive >= ProbeLimit)
+            yield();
+    ProbeActive++;
+    __run_thread(probe_thread, probe, desc, func, __builtin_return_address(0));
+}
+
+/*
+ * handle_post()
+ *  dopost()
+ *   reloc_preinit(f==maininit)
+ *    maininit()
+ *     device_hardware_setup()
+ *      probe_report()
+ *     prepareboot()
+ *      thread_prepboot()
+ *       probe_report()
+ */
+// Print the start/finish times of all probes, relative to the first one.
+// Finished probes are dropped from the list; probes still running (they
+// may continue during option rom execution) are reported again by
+// thread_prepboot() at the end of POST.
+void
+probe_report(void)
+{
+    ASSERT32FLAT();
+    if (hlist_empty(&ProbeList))
+        return;
+    u32 base = ProbeBase;
+    dprintf(1, "Device probe times (ms since first probe):\n");
+    struct probe_s *probe;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(probe, n, &ProbeList, node) {
+        const char *desc = probe->desc ?: "?";
+        u32 queued = timer_ticks_to_us(probe->queued - base) / 1000;
+        if (!probe->end) {
+            dprintf(1, "  %s: queued %u, still running\n", desc, queued);
+            continue;
+        }
+        dprintf(1, "  %s: queued %u, start %u, finish %u (%u ms)\n"
+                , desc, queued
+                , timer_ticks_to_us(probe->start - base) / 1000
+                , timer_ticks_to_us(probe->end - base) / 1000
+                , timer_ticks_to_us(probe->end - probe->start) / 1000);
+        if (ProbeLast == &probe->node.next)
+            ProbeLast = probe->node.pprev;
+        hlist_del(&probe->node);
+        free(probe);
+    }
+}
+
+
 /****************************************************************
  * Thread preemption
  ****************************************************************/
@@ -38,10 +38,15 @@ extern struct thread_info MainThread;
 struct thread_info *getCurThread(void);
 void yield(void);
 void yield_toirq(void);
+int yield_wait(int (*cond)(void *data), void *data, u32 end);
 void thread_setup(void);
+void thread_prepboot(void);
 int threads_during_optionroms(void);
 void run_thread(void (*func)(void*), void *data);
 void wait_threads(void);
+#define MAXPROBEDESC 32
+void run_probe(const char *desc, void (*func)(void*), void *data);
+void probe_report(void);
 struct mutex_s { u32 isLocked; };
 void mutex_lock(struct mutex_s *mutex);
 void mutex_unlock(struct mutex_s *mutex);
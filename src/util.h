@@ -159,6 +159,7 @@ extern u32 MaxCountCPUs;
 void wrmsr_smp(u32 index, u64 val);
 void smp_setup(void);
 void smp_resume(void);
+void smp_prepboot(void);
 int apic_id_is_present(u8 apic_id);
 
 // hw/dma.c
@@ -185,6 +186,8 @@ void sdcard_setup(void);
 void timer_setup(void);
 void pmtimer_setup(u16 ioport);
 void tsctimer_setfreq(u32 khz, const char *src);
+u32 timer_read(void);
+u32 timer_ticks_to_us(u32 ticks);
 u32 timer_calc(u32 msecs);
 u32 timer_calc_usec(u32 usecs);
 int timer_check(u32 end);
@@ -205,6 +205,10 @@ static inline void smp_rmb(void) {
 static inline void smp_wmb(void) {
     barrier();
 }
+/* Stores may still be reordered after later loads */
+static inline void smp_mb(void) {
+    asm volatile("lock; addl $0,0(%%esp)" : : : "memory");
+}
 
 static inline void writel(void *addr, u32 val) {
     barrier();